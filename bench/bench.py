@@ -0,0 +1,385 @@
+#!/usr/bin/env python3
+"""Run the Lispy benchmark workloads and report time, allocations and memory.
+
+Each workload is a program run as `main FILE`. The ones in this directory are
+written by hand; the rest are generated, since they're mostly input.
+
+    bench.py --binary target/main
+    bench.py --binary target/main --save baseline.json
+    bench.py --binary target/main --compare baseline.json
+
+Exits with 1 when comparing and any workload got slower than the threshold.
+"""
+
+import argparse
+import functools
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def gen_startup(tmp):
+    # Nothing to run, just launching and setting up
+    return ""
+
+
+def gen_nesting(tmp, depth=100, repeat=200):
+    # (+ 1 (+ 1 (+ 1 ... 0))), a hundred deep
+    expr = "(+ 1 " * depth + "0" + ")" * depth
+    return "\n".join(["(def {x} %s)" % expr] * repeat) + "\n"
+
+
+def gen_defs(tmp, n=5000):
+    # Many globals, each defined from the previous one
+    lines = ["(def {v0} 0)"]
+    lines += ["(def {v%d} (+ v%d 1))" % (i, i - 1) for i in range(1, n)]
+    return "\n".join(lines) + "\n"
+
+
+def gen_parse(tmp, n=20000):
+    # Mostly reading: long literal lists of numbers, symbols and nesting
+    items = []
+    for i in range(n):
+        if i % 10 == 0:
+            items.append("{%d sym%d {%d}}" % (i, i, -i))
+        else:
+            items.append("%d" % i)
+
+    body = " ".join(items)
+    return "".join("(def {data%d} {%s})\n" % (i, body) for i in range(5))
+
+
+def gen_read(tmp, n=80000):
+    # About 9MB of definitions with every kind of token, read but not run
+    line = ('(def {fn%d} (\\ {x y} {if (> x %d) {join {"label %d\\n" sym-%d}'
+            ' (list x y -%d)} {+ x y %d}}))\n')
+    return "".join(line % (i, i, i, i, i, i) for i in range(n))
+
+
+def gen_ops(tmp, n=60000):
+    # Definitions heavy on `-` and negative numbers, tokens that start alike
+    line = "(def {d%d} (\\ {x y} {- (- x y -%d) (- y %d) -1}))\n"
+    return "".join(line % (i, i, i) for i in range(n))
+
+
+def gen_scan(tmp, mb=64):
+    # Deeply indented definitions with long names and strings, where most of
+    # the bytes are in runs of the same kind. Tokenized, not read
+    doc = "documentation for the setting, as it would be shown to a user " * 2
+    line = ("%s(def {configuration-setting-%012d-used-by-the-scanner-workload}"
+            "\n%s  \"%s%012d\"\n%s  {%018d -%018d})\n")
+    indent = " " * 32
+    sample = line % (indent, 0, indent, doc, 0, indent, 0, 0)
+    return "".join(line % (indent, i, indent, doc, i, indent, i, i)
+                   for i in range(mb * 1000 * 1000 // len(sample)))
+
+
+def gen_print(tmp, doublings=15, repeat=30):
+    # Printing a list of ~130k atoms and sublists, built by doubling a small one
+    lines = ["(def {l0} {1 -22 {333 sym {-4444}} 55555})"]
+    lines += ["(def {l%d} (join l%d l%d))" % (i, i - 1, i - 1)
+              for i in range(1, doublings + 1)]
+    lines += ["(print l%d)" % doublings] * repeat
+    return "\n".join(lines) + "\n"
+
+
+def gen_map(tmp, n=200000, lookups=20000, updates=10):
+    # A map of `n` entries made in one call, then looked up, half deleted and
+    # updated while a global holds it, so each update copies the table
+    keys = " ".join("k%d" % i for i in range(n))
+    vals = " ".join("%d" % i for i in range(n))
+    lines = ["(def {m} (hashmap {%s} %s))" % (keys, vals)]
+    lines += ["(get m {k%d})" % (i * 7919 % n) for i in range(lookups)]
+    lines += ["(def {m} (delete m {%s}))"
+              % " ".join("k%d" % i for i in range(0, n, 2))]
+    lines += ["(def {m} (put m {k%d} 0))" % i for i in range(updates)]
+    return "\n".join(lines) + "\n"
+
+
+def gen_list(tmp, doublings=4, uses=100):
+    # A list of 2^doublings numbers, then read through its global `uses` times.
+    # Reads shouldn't cost more for a list of a million than for one of 16
+    lines = ["(def {l} {0})"]
+    lines += ["(def {l} (join l l))"] * doublings
+    lines += ["(len l)", "(head l)"] * uses
+    return "\n".join(lines) + "\n"
+
+
+def gen_fiber_switch(tmp, fibers=1000, yields=50):
+    # Fibers spawned together, each yielding to the next `yields` times
+    lines = ["(def {spin} (\\ {y n} {if (== n 0) {n} "
+             "{spin (call yield) (- n 1)}}))"]
+    lines += ["(list %s)" % " ".join(["(spawn {spin () %d})" % yields] * fibers)]
+    return "\n".join(lines) + "\n"
+
+
+def gen_channel(tmp, pairs=100, messages=200):
+    # Producers and consumers passing numbers through a channel with room for
+    # one, so most sends and receives park the fiber
+    lines = [
+        "(def {c} (chan 1))",
+        "(def {produce} (\\ {s n} {if (== n 0) {n} "
+        "{produce (send c n) (- n 1)}}))",
+        "(def {consume} (\\ {acc n} {if (== n 0) {acc} "
+        "{consume (+ acc (recv c)) (- n 1)}}))",
+    ]
+    spawns = ["(spawn {produce () %d}) (spawn {consume 0 %d})"
+              % (messages, messages)] * pairs
+    lines.append("(list %s)" % " ".join(spawns))
+    return "\n".join(lines) + "\n"
+
+
+def gen_dataset(n=15000):
+    # Records of numbers, strings and repeated field names, about 1MB of text
+    records = ['{id %d name "item %d" tags {t%d t%d} score %d}'
+               % (i, i, i % 7, i % 11, -i * 37) for i in range(n)]
+    return "{%s}" % " ".join(records)
+
+
+def gen_data_text(tmp):
+    # Loading a dataset by parsing it
+    return "(def {data} %s)\n(len data)\n" % gen_dataset()
+
+
+def gen_data_bin(tmp):
+    # The same dataset, loaded from the binary encoding
+    return '(def {data} (load "%s"))\n(len data)\n' % os.path.join(tmp, "data.bin")
+
+
+def gen_data_view(tmp):
+    # The same dataset mapped in place, reading a single record
+    return ('(def {data} (view "%s"))\n(len data)\n(head (tail (tail data)))\n'
+            % os.path.join(tmp, "data.view"))
+
+
+def setup_data(binary, tmp, save, name):
+    # Saved by the binary under test, so it's in the format that binary reads
+    path = os.path.join(tmp, name + "-save.lspy")
+    with open(path, "w") as f:
+        f.write('(%s "%s" %s)\n' % (save, os.path.join(tmp, name), gen_dataset()))
+
+    run_once([binary, path])
+
+
+def gen_prelude(n=2000):
+    # Helpers and small tables, the kind of globals a prelude defines
+    lines = ["(def {f%d} (\\ {x} {+ x %d}))" % (i, i) for i in range(n)]
+    lines += ['(def {t%d} {%d s%d "v%d"})' % (i, i, i, i) for i in range(n)]
+    return "\n".join(lines) + "\n"
+
+
+def gen_boot_source(tmp):
+    # Time to the first result, running the prelude first
+    return gen_prelude() + "(f1 1)\n"
+
+
+def gen_boot_image(tmp):
+    # The same, starting from an image of the prelude's globals
+    return "(f1 1)\n"
+
+
+def setup_boot_image(binary, tmp):
+    path = os.path.join(tmp, "prelude.lspy")
+    with open(path, "w") as f:
+        f.write(gen_prelude())
+
+    run_once([binary, "--save-image=" + os.path.join(tmp, "prelude.img"), path])
+
+
+WORKLOADS = {
+    "startup": gen_startup,
+    "arith": os.path.join(HERE, "arith.lspy"),
+    "qexpr": os.path.join(HERE, "qexpr.lspy"),
+    "nesting": gen_nesting,
+    "defs": gen_defs,
+    "parse": gen_parse,
+    "read": gen_read,
+    "read-par": gen_read,
+    "tokenize": gen_read,
+    "ops": gen_ops,
+    "ops-retry": gen_ops,
+    "scan": gen_scan,
+    "scan-scalar": gen_scan,
+    "print": gen_print,
+    "map": gen_map,
+    "list-small": gen_list,
+    "list-large": functools.partial(gen_list, doublings=20),
+    "yield": gen_fiber_switch,
+    "channel": gen_channel,
+    "data-text": gen_data_text,
+    "data-bin": gen_data_bin,
+    "data-view": gen_data_view,
+    "boot-source": gen_boot_source,
+    "boot-image": gen_boot_image,
+}
+
+# Run once before a workload, to create files it reads
+SETUP = {
+    "data-bin": lambda binary, tmp: setup_data(binary, tmp, "save", "data.bin"),
+    "data-view": lambda binary, tmp: setup_data(binary, tmp, "save-view",
+                                                "data.view"),
+    "boot-image": setup_boot_image,
+}
+
+# Options a workload is run with
+FLAGS = {
+    "read": lambda tmp: ["--read-only"],
+    "tokenize": lambda tmp: ["--tokenize"],
+    "ops": lambda tmp: ["--read-only"],
+    "ops-retry": lambda tmp: ["--read-only", "--no-predict"],
+    "scan": lambda tmp: ["--tokenize"],
+    "scan-scalar": lambda tmp: ["--tokenize", "--no-simd"],
+    "boot-image": lambda tmp: ["--image=" + os.path.join(tmp, "prelude.img")],
+}
+
+
+def run_once(cmd):
+    """Wall time in seconds and peak RSS in KB of one run of `cmd`"""
+    # Errors go to a file rather than a pipe, which would fill up and block
+    # the child while it's waited for
+    with tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=stderr)
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        stderr.seek(0)
+        err = stderr.read().decode(errors="replace")
+
+    if proc.returncode != 0:
+        sys.exit("%s failed (%d):\n%s" % (" ".join(cmd), proc.returncode, err))
+
+    return elapsed, usage.ru_maxrss
+
+
+def percentile(xs, p):
+    xs = sorted(xs)
+    return xs[min(len(xs) - 1, int(round(p / 100 * (len(xs) - 1))))]
+
+
+def bench(binary, name, path, warmup, runs, flags):
+    for _ in range(warmup):
+        run_once([binary] + flags + [path])
+
+    times, rss = [], []
+    for _ in range(runs):
+        t, kb = run_once([binary] + flags + [path])
+        times.append(t)
+        rss.append(kb)
+
+    # One more run, counting allocations
+    with tempfile.NamedTemporaryFile(suffix=".json") as f:
+        run_once([binary, "--stats=" + f.name] + flags + [path])
+        stats = json.load(open(f.name))
+
+    return {
+        "median_ms": statistics.median(times) * 1000,
+        "mb_s": os.path.getsize(path) / statistics.median(times) / 1e6,
+        "p95_ms": percentile(times, 95) * 1000,
+        "allocs": sum(stats["allocs"].values()),
+        "bytes": stats["bytes"],
+        "peak_rss_kb": max(rss),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--binary", default="target/main")
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument("--warmup", type=int, default=2)
+    parser.add_argument("--only", action="append", help="run just this workload")
+    parser.add_argument("--save", help="write the results to this JSON file")
+    parser.add_argument("--compare", help="baseline JSON from an earlier --save")
+    parser.add_argument(
+        "--scan-mb",
+        type=int,
+        default=64,
+        help="size of the scan workloads, 1024 for a 1GB input (default 64)",
+    )
+    parser.add_argument(
+        "--map-entries",
+        type=int,
+        default=200000,
+        help="size of the map workload, 10000000 for 10M entries "
+        "(default 200000)",
+    )
+    parser.add_argument(
+        "--read-threads",
+        type=int,
+        default=os.cpu_count(),
+        help="threads for the read-par workload (default one per CPU)",
+    )
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.10,
+        help="slowdown of the median that counts as a regression (default 0.10)",
+    )
+    args = parser.parse_args()
+
+    WORKLOADS["scan"] = WORKLOADS["scan-scalar"] = functools.partial(
+        gen_scan, mb=args.scan_mb)
+    WORKLOADS["map"] = functools.partial(gen_map, n=args.map_entries)
+    FLAGS["read-par"] = lambda tmp: [
+        "--read-only", "--read-threads=%d" % args.read_threads]
+
+    baseline = json.load(open(args.compare)) if args.compare else {}
+    results = {}
+    regressions = []
+
+    header = "%-11s %10s %10s %9s %12s %12s %10s" % (
+        "workload", "median ms", "p95 ms", "MB/s", "allocs", "bytes", "rss KB")
+    if baseline:
+        header += " %9s" % "vs base"
+    print(header)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, source in WORKLOADS.items():
+            if args.only and name not in args.only:
+                continue
+
+            if name in SETUP:
+                SETUP[name](args.binary, tmp)
+
+            path = source
+            if callable(source):
+                path = os.path.join(tmp, name + ".lspy")
+                with open(path, "w") as f:
+                    f.write(source(tmp))
+
+            flags = FLAGS[name](tmp) if name in FLAGS else []
+            r = bench(args.binary, name, path, args.warmup, args.runs, flags)
+            results[name] = r
+
+            line = "%-11s %10.1f %10.1f %9.1f %12d %12d %10d" % (
+                name, r["median_ms"], r["p95_ms"], r["mb_s"], r["allocs"],
+                r["bytes"], r["peak_rss_kb"])
+
+            if name in baseline:
+                change = r["median_ms"] / baseline[name]["median_ms"] - 1
+                line += " %+8.1f%%" % (change * 100)
+
+                if change > args.threshold:
+                    line += "  REGRESSION"
+                    regressions.append(name)
+
+            print(line, flush=True)
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+
+    if regressions:
+        sys.exit("Slower than baseline: " + ", ".join(regressions))
+
+
+if __name__ == "__main__":
+    main()
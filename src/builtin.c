@@ -1,6 +1,18 @@
 #include "builtin.h"
 
+#include <string.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "fold.h"
+#include "future.h"
 #include "lval.h"
+#include "map.h"
+#include "par.h"
+#include "print.h"
+#include "serial.h"
+#include "stats.h"
+#include "view.h"
 
 #define LASSERT(args, cond, fmt, ...)         \
   if (!(cond)) {                              \
@@ -10,6 +22,8 @@
   }
 
 lval* builtin_op(lenv* e, lval* a, char* op) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no arguments!", op);
+
   // Ensure all arguments are numbers
   for (int i = 0; i < a->count; i++) {
     if (a->cell[i]->type != LVAL_NUM) {
@@ -38,6 +52,7 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
         lval_del(y);
 
         x = lval_err("Division by zero!");
+        break;
       }
 
       x->num /= y->num;
@@ -61,31 +76,41 @@ lval* builtin_head(lenv* e, lval* a) {
           "Function 'head' passed too many arguments. "
           "Got %i, expected %i.",
           a->count, 1);
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VIEW,
           "Function 'head' passed incorrect type for argument 0. "
           "Got %s, Expected %s.",
           ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
   LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
 
-  // Otherwise, take first argument
-  lval* v = lval_take(a, 0);
-
-  // Cleanup
-  while (v->count > 1) lval_del(lval_pop(v, 1));
+  // Only the first element of a view is read
+  if (a->cell[0]->type == LVAL_VIEW) {
+    lval* x = lval_add(lval_qexpr(), lview_cell(a->cell[0], 0));
+    lval_del(a);
+    return x;
+  }
 
-  return v;
+  // Otherwise, take the first element of the first argument, and drop the
+  // rest
+  return lval_add(lval_qexpr(), lval_take(lval_take(a, 0), 0));
 }
 
 lval* builtin_tail(lenv* e, lval* a) {
   // Error conditions
   LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VIEW,
           "Function 'tail' passed incorrect types!");
   LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
 
   // Otherwise, take first argument
   lval* v = lval_take(a, 0);
 
+  // The tail of a view is the same cells, one further along
+  if (v->type == LVAL_VIEW) {
+    v->nodes++;
+    v->count--;
+    return v;
+  }
+
   // Delete first element and return
   lval_del(lval_pop(v, 0));
 
@@ -109,7 +134,42 @@ lval* builtin_eval(lenv* e, lval* a) {
   return lval_eval(e, x);
 }
 
+// Call a function with the arguments after it. `(f)` on its own is `f`, so
+// this is how functions that take none are called. Ex: (call yield)
+lval* builtin_call(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'call' passed no arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_FUN,
+          "Function 'call' passed incorrect types!");
+
+  lval* f = lval_pop(a, 0);
+  lval* x = lval_call(e, f, a);
+  lval_del(f);
+
+  return x;
+}
+
+lval* builtin_par(lenv* e, lval* a) {
+  lval_own(a);
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+            "Function 'par' passed incorrect type.");
+    a->cell[i]->type = LVAL_SEXPR;
+  }
+
+  par_eval_all(e, a->cell, a->count);
+
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_ERR) return lval_take(a, i);
+  }
+
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
 lval* builtin_join(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'join' passed no arguments!");
+
   for (int i = 0; i < a->count; i++) {
     LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
             "Function 'join' passed incorrect type.");
@@ -128,7 +188,7 @@ lval* builtin_join(lenv* e, lval* a) {
 
 lval* builtin_len(lenv* e, lval* a) {
   LASSERT(a, a->count == 1, "Function 'len' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR || a->cell[0]->type == LVAL_VIEW,
           "Function 'len' passed incorrect type.");
 
   lval* x = lval_take(a, 0);
@@ -139,9 +199,10 @@ lval* builtin_len(lenv* e, lval* a) {
   return len;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
+lval* builtin_var(lenv* e, lval* a, char* func) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no arguments!", func);
   LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-          "Function 'def' passed incorrect types!");
+          "Function '%s' passed incorrect types!", func);
 
   // First argument is a symbol list
   lval* symbols = a->cell[0];
@@ -149,35 +210,478 @@ lval* builtin_def(lenv* e, lval* a) {
   // Validate they're all symbols
   for (int i = 0; i < symbols->count; i++) {
     LASSERT(a, symbols->cell[i]->type == LVAL_SYM,
-            "Function 'def' cannot define non-symbol");
+            "Function '%s' cannot define non-symbol", func);
   }
 
   LASSERT(a, symbols->count == a->count - 1,
-          "Function 'def' cannot define incorrect "
-          "number of values to symbols");
+          "Function '%s' cannot define incorrect "
+          "number of values to symbols",
+          func);
 
-  // Assign copies of values to symbols
+  // Assign copies of values to symbols, globally for `def` and in the current
+  // scope for `=`
   for (int i = 0; i < symbols->count; i++) {
-    lenv_put(e, symbols->cell[i], a->cell[i + 1]);
+    if (strcmp(func, "def") == 0) lenv_def(e, symbols->cell[i], a->cell[i + 1]);
+    if (strcmp(func, "=") == 0) lenv_put(e, symbols->cell[i], a->cell[i + 1]);
+  }
+
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
+lval* builtin_assign(lenv* e, lval* a) { return builtin_var(e, a, "="); }
+
+lval* builtin_lambda(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function '\\' passed incorrect number of arguments. "
+          "Got %i, Expected %i.",
+          a->count, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[1]->type == LVAL_QEXPR,
+          "Function '\\' passed incorrect types!");
+
+  // Formals must all be symbols
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+            "Cannot define non-symbol. Got %s, Expected %s.",
+            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_take(a, 0);
+
+  return lval_lambda(e, formals, body);
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+  LASSERT(a, a->count == 2,
+          "Function '%s' passed incorrect number of arguments. "
+          "Got %i, Expected %i.",
+          op, a->count, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM,
+          "Function '%s' passed incorrect types!", op);
+
+  long x = a->cell[0]->num;
+  long y = a->cell[1]->num;
+  int r = 0;
+
+  if (strcmp(op, ">") == 0) r = x > y;
+  if (strcmp(op, "<") == 0) r = x < y;
+  if (strcmp(op, ">=") == 0) r = x >= y;
+  if (strcmp(op, "<=") == 0) r = x <= y;
+
+  lval_del(a);
+
+  return lval_num(r);
+}
+
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">="); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
+
+lval* builtin_cmp(lenv* e, lval* a, char* op) {
+  LASSERT(a, a->count == 2,
+          "Function '%s' passed incorrect number of arguments. "
+          "Got %i, Expected %i.",
+          op, a->count, 2);
+
+  int r = lval_eq(a->cell[0], a->cell[1]);
+  if (strcmp(op, "!=") == 0) r = !r;
+
+  lval_del(a);
+
+  return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
+
+lval* builtin_if(lenv* e, lval* a) {
+  LASSERT(a, a->count == 3,
+          "Function 'if' passed incorrect number of arguments. "
+          "Got %i, Expected %i.",
+          a->count, 3);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM,
+          "Function 'if' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_NUM));
+  LASSERT(a, a->cell[1]->type == LVAL_QEXPR && a->cell[2]->type == LVAL_QEXPR,
+          "Function 'if' passed incorrect types!");
+
+  // Evaluate the chosen branch as an S-Expression
+  lval* x = lval_pop(a, a->cell[0]->num ? 1 : 2);
+  x->type = LVAL_SEXPR;
+
+  lval_del(a);
+
+  return lval_eval(e, x);
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'spawn' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+          "Function 'spawn' passed incorrect types!");
+
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+
+  if (!fiber_spawn(e, x, NULL, NULL)) {
+    lval_del(x);
+    return lval_err("Could not allocate a fiber stack");
   }
 
+  return lval_sexpr();
+}
+
+lval* builtin_yield(lenv* e, lval* a) {
+  LASSERT(a, a->count == 0, "Function 'yield' passed too many arguments!");
+
   lval_del(a);
+  fiber_yield();
 
   return lval_sexpr();
 }
 
+lval* builtin_chan(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'chan' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_NUM,
+          "Function 'chan' passed incorrect types!");
+  LASSERT(a, a->cell[0]->num > 0, "Function 'chan' needs a capacity above 0");
+
+  lval* c = lval_chan(lchan_new(a->cell[0]->num));
+  lval_del(a);
+
+  return c;
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function 'send' passed incorrect number of arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+          "Function 'send' passed incorrect types!");
+
+  lval* c = lval_pop(a, 0);
+  lval* result = lchan_send(c->chan, lval_take(a, 0));
+  lval_del(c);
+
+  return result;
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'recv' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+          "Function 'recv' passed incorrect types!");
+
+  lval* c = lval_take(a, 0);
+  lval* result = lchan_recv(c->chan);
+  lval_del(c);
+
+  return result;
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'future' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+          "Function 'future' passed incorrect types!");
+
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+
+  return lval_fut(lfuture_new(e, x));
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'await' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_FUT,
+          "Function 'await' passed incorrect types!");
+
+  lval* f = lval_take(a, 0);
+  lval* result = lfuture_await(f->fut);
+  lval_del(f);
+
+  return result;
+}
+
+// Maps take their keys as a Q-Expression, like `def` takes symbols. Ex:
+// (put m {a b} 1 2)
+lval* builtin_hashmap(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'hashmap' passed no arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+          "Function 'hashmap' passed incorrect types!");
+
+  // Same as putting everything into an empty map
+  lval* x = lval_add(lval_sexpr(), lval_map(lmap_new()));
+
+  return builtin_put(e, lval_join(x, a));
+}
+
+lval* builtin_get(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function 'get' passed incorrect number of arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_MAP && a->cell[1]->type == LVAL_QEXPR,
+          "Function 'get' passed incorrect types!");
+  LASSERT(a, a->cell[1]->count == 1, "Function 'get' needs exactly one key");
+
+  lval* key = a->cell[1]->cell[0];
+  LASSERT(a, lmap_can_key(key),
+          "Function 'get' passed incorrect key type. "
+          "Got %s, Expected Number or Symbol.",
+          ltype_name(key->type));
+
+  lval* v = lmap_get(a->cell[0]->map, key);
+  lval* x = v ? lval_copy(v) : lval_err("Key not found in map");
+
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 2,
+          "Function 'put' passed incorrect number of arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_MAP && a->cell[1]->type == LVAL_QEXPR,
+          "Function 'put' passed incorrect types!");
+
+  lval* keys = a->cell[1];
+
+  for (int i = 0; i < keys->count; i++) {
+    LASSERT(a, lmap_can_key(keys->cell[i]),
+            "Function 'put' passed incorrect key type. "
+            "Got %s, Expected Number or Symbol.",
+            ltype_name(keys->cell[i]->type));
+  }
+
+  LASSERT(a, keys->count == a->count - 2,
+          "Function 'put' cannot put incorrect "
+          "number of values to keys");
+
+  lval* x = lval_pop(a, 0);
+  x->map = lmap_own(x->map);
+
+  for (int i = 0; i < keys->count; i++) {
+    lmap_put(x->map, keys->cell[i], a->cell[i + 1]);
+  }
+
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_delete(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function 'delete' passed incorrect number of arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_MAP && a->cell[1]->type == LVAL_QEXPR,
+          "Function 'delete' passed incorrect types!");
+
+  lval* keys = a->cell[1];
+
+  for (int i = 0; i < keys->count; i++) {
+    LASSERT(a, lmap_can_key(keys->cell[i]),
+            "Function 'delete' passed incorrect key type. "
+            "Got %s, Expected Number or Symbol.",
+            ltype_name(keys->cell[i]->type));
+  }
+
+  lval* x = lval_pop(a, 0);
+  x->map = lmap_own(x->map);
+
+  for (int i = 0; i < keys->count; i++) {
+    lmap_delete(x->map, keys->cell[i]);
+  }
+
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_keys(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1, "Function 'keys' passed too many arguments!");
+  LASSERT(a, a->cell[0]->type == LVAL_MAP,
+          "Function 'keys' passed incorrect types!");
+
+  lval* x = lmap_keys(a->cell[0]->map);
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_stats(lenv* e, lval* a) {
+  LASSERT(a, a->count == 0, "Function 'stats' passed too many arguments!");
+  LASSERT(a, lstats_enabled, "Stats disabled; run with --stats");
+
+  lval_del(a);
+
+  return lstats_map();
+}
+
+lval* builtin_save(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function 'save' passed incorrect number of arguments. "
+          "Got %i, expected %i.",
+          a->count, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_STR,
+          "Function 'save' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+  lval* x = lser_save(a->cell[0]->str, a->cell[1]);
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1,
+          "Function 'load' passed incorrect number of arguments. "
+          "Got %i, expected %i.",
+          a->count, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_STR,
+          "Function 'load' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+  lval* x = lser_load(e, a->cell[0]->str);
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_save_view(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2,
+          "Function 'save-view' passed incorrect number of arguments. "
+          "Got %i, expected %i.",
+          a->count, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_STR,
+          "Function 'save-view' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+  lval* x = lview_save(a->cell[0]->str, a->cell[1]);
+  lval_del(a);
+
+  return x;
+}
+
+lval* builtin_view(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1,
+          "Function 'view' passed incorrect number of arguments. "
+          "Got %i, expected %i.",
+          a->count, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_STR,
+          "Function 'view' passed incorrect type for argument 0. "
+          "Got %s, Expected %s.",
+          ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+  lval* x = lview_load(a->cell[0]->str);
+  lval_del(a);
+
+  return x;
+}
+
+// Print every argument on one line, all of it in a single write
+lval* builtin_print(lenv* e, lval* a) {
+  lbuf b;
+  lbuf_init(&b);
+
+  for (int i = 0; i < a->count; i++) {
+    if (i) lbuf_putc(&b, ' ');
+    lval_write(&b, a->cell[i]);
+  }
+
+  lbuf_putc(&b, '\n');
+  lbuf_flush(&b, STDOUT_FILENO);
+  lbuf_free(&b);
+
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+// Every builtin, under the name `add_builtins` binds it to
+static const struct {
+  char* name;
+  lbuiltin func;
+} builtins[] = {
+    // Variable functions
+    {"\\", builtin_lambda},
+    {"def", builtin_def},
+    {"=", builtin_assign},
+
+    // List functions
+    {"list", builtin_list},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"eval", builtin_eval},
+    {"call", builtin_call},
+    {"join", builtin_join},
+    {"len", builtin_len},
+    {"par", builtin_par},
+
+    // Maps
+    {"hashmap", builtin_hashmap},
+    {"get", builtin_get},
+    {"put", builtin_put},
+    {"delete", builtin_delete},
+    {"keys", builtin_keys},
+
+    // Fibers
+    {"spawn", builtin_spawn},
+    {"yield", builtin_yield},
+    {"chan", builtin_chan},
+    {"send", builtin_send},
+    {"recv", builtin_recv},
+    {"future", builtin_future},
+    {"await", builtin_await},
+
+    // Mathematical functions
+    {"+", builtin_add},
+    {"-", builtin_sub},
+    {"*", builtin_mul},
+    {"/", builtin_div},
+
+    // Comparison functions
+    {"if", builtin_if},
+    {"==", builtin_eq},
+    {"!=", builtin_ne},
+    {">", builtin_gt},
+    {"<", builtin_lt},
+    {">=", builtin_ge},
+    {"<=", builtin_le},
+
+    // Input and output
+    {"print", builtin_print},
+    {"save", builtin_save},
+    {"load", builtin_load},
+    {"save-view", builtin_save_view},
+    {"view", builtin_view},
+
+    // Instrumentation
+    {"stats", builtin_stats},
+};
+
+#define BUILTINS_COUNT (int)(sizeof(builtins) / sizeof(builtins[0]))
+
 void add_builtins(lenv* e) {
-  // List functions
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-
-  // Mathematical functions
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+  for (int i = 0; i < BUILTINS_COUNT; i++) {
+    lenv_add_builtin(e, builtins[i].name, builtins[i].func);
+  }
+}
+
+// Name of the builtin `f`, so it can be written out and found again
+char* builtin_name(lbuiltin f) {
+  for (int i = 0; i < BUILTINS_COUNT; i++) {
+    if (builtins[i].func == f) return builtins[i].name;
+  }
+
+  return NULL;
+}
+
+lbuiltin builtin_named(char* name) {
+  for (int i = 0; i < BUILTINS_COUNT; i++) {
+    if (strcmp(builtins[i].name, name) == 0) return builtins[i].func;
+  }
+
+  return NULL;
 }
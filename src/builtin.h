@@ -11,8 +11,42 @@ lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_call(lenv* e, lval* a);
+lval* builtin_par(lenv* e, lval* a);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_len(lenv* e, lval* a);
+lval* builtin_var(lenv* e, lval* a, char* func);
 lval* builtin_def(lenv* e, lval* a);
+lval* builtin_assign(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_ord(lenv* e, lval* a, char* op);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+lval* builtin_cmp(lenv* e, lval* a, char* op);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_hashmap(lenv* e, lval* a);
+lval* builtin_get(lenv* e, lval* a);
+lval* builtin_put(lenv* e, lval* a);
+lval* builtin_delete(lenv* e, lval* a);
+lval* builtin_keys(lenv* e, lval* a);
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_yield(lenv* e, lval* a);
+lval* builtin_chan(lenv* e, lval* a);
+lval* builtin_send(lenv* e, lval* a);
+lval* builtin_recv(lenv* e, lval* a);
+lval* builtin_future(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+lval* builtin_save(lenv* e, lval* a);
+lval* builtin_load(lenv* e, lval* a);
+lval* builtin_save_view(lenv* e, lval* a);
+lval* builtin_view(lenv* e, lval* a);
+lval* builtin_print(lenv* e, lval* a);
+lval* builtin_stats(lenv* e, lval* a);
 
 void add_builtins(lenv* e);
+char* builtin_name(lbuiltin f);
+lbuiltin builtin_named(char* name);
@@ -0,0 +1,335 @@
+#include "fast.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "builtin.h"
+
+int lval_fast_enabled = 1;
+
+// Forms with a fused implementation, picked from what dominates the recursive
+// benchmarks: arithmetic and comparisons on locals and constants, walking a
+// list with `head`/`tail`, and `eval` of a quoted expression
+typedef enum {
+  LOP_NONE,
+  LOP_ADD,
+  LOP_SUB,
+  LOP_MUL,
+  LOP_DIV,
+  LOP_GT,
+  LOP_LT,
+  LOP_GE,
+  LOP_LE,
+  LOP_EQ,
+  LOP_NE,
+  LOP_HEAD,
+  LOP_TAIL,
+  LOP_EVAL,
+} lop;
+
+static lop lop_of(lbuiltin f) {
+  if (f == builtin_add) return LOP_ADD;
+  if (f == builtin_sub) return LOP_SUB;
+  if (f == builtin_mul) return LOP_MUL;
+  if (f == builtin_div) return LOP_DIV;
+  if (f == builtin_gt) return LOP_GT;
+  if (f == builtin_lt) return LOP_LT;
+  if (f == builtin_ge) return LOP_GE;
+  if (f == builtin_le) return LOP_LE;
+  if (f == builtin_eq) return LOP_EQ;
+  if (f == builtin_ne) return LOP_NE;
+  if (f == builtin_head) return LOP_HEAD;
+  if (f == builtin_tail) return LOP_TAIL;
+  if (f == builtin_eval) return LOP_EVAL;
+  return LOP_NONE;
+}
+
+static int lop_is_binary(lop op) { return op >= LOP_ADD && op <= LOP_NE; }
+
+// Apply a binary operation to two numbers, without the `strcmp` chains of
+// `builtin_op` and `builtin_ord`. Returns 0 when the generic builtin has to run
+// instead, so it can report the error
+static int lop_num(lop op, long x, long y, long* r) {
+  // clang-format off
+  switch (op) {
+    case LOP_ADD: *r = x + y; return 1;
+    case LOP_SUB: *r = x - y; return 1;
+    case LOP_MUL: *r = x * y; return 1;
+    case LOP_DIV: if (y == 0) return 0; *r = x / y; return 1;
+    case LOP_GT: *r = x > y; return 1;
+    case LOP_LT: *r = x < y; return 1;
+    case LOP_GE: *r = x >= y; return 1;
+    case LOP_LE: *r = x <= y; return 1;
+    case LOP_EQ: *r = x == y; return 1;
+    case LOP_NE: *r = x != y; return 1;
+    default: return 0;
+  }
+  // clang-format on
+}
+
+// A number literal, or a symbol bound to one. The binding is read in place
+// rather than copied out of the environment
+static int lval_operand(lenv* e, lval* v, long* x) {
+  if (v->type == LVAL_SYM) v = lenv_lookup(e, v->sym);
+  if (v == NULL || v->type != LVAL_NUM) return 0;
+
+  *x = v->num;
+  return 1;
+}
+
+// A symbol bound to a non-empty Q-Expression, read in place
+static lval* lval_list_operand(lenv* e, lval* v) {
+  if (v->type != LVAL_SYM) return NULL;
+
+  lval* l = lenv_lookup(e, v->sym);
+  if (l == NULL || l->type != LVAL_QEXPR || l->count == 0) return NULL;
+
+  return l;
+}
+
+// Evaluate `v`, a call to `f`, without building an argument list if it's one
+// of the fused forms. Anything unusual, including every error, returns NULL
+// and is left to `lval_eval_sexpr`
+lval* lval_eval_fast(lenv* e, lval* v, lval* f) {
+  if (!lval_fast_enabled || v->count < 2) return NULL;
+  if (f->type != LVAL_FUN || f->fun == NULL) return NULL;
+
+  lop op = lop_of(f->fun);
+
+  // `(op a b)` on locals and constants
+  if (lop_is_binary(op)) {
+    long x, y, r;
+    if (v->count != 3 || !lval_operand(e, v->cell[1], &x) ||
+        !lval_operand(e, v->cell[2], &y) || !lop_num(op, x, y, &r))
+      return NULL;
+
+    lval_del(v);
+    return lval_num(r);
+  }
+
+  if (v->count != 2) return NULL;
+
+  // `(head l)` copies only the first element of `l`
+  if (op == LOP_HEAD) {
+    lval* l = lval_list_operand(e, v->cell[1]);
+    if (l == NULL) return NULL;
+
+    lval* x = lval_add(lval_qexpr(), lval_copy(l->cell[0]));
+    lval_del(v);
+    return x;
+  }
+
+  // `(tail l)` copies everything but the first element of `l`
+  if (op == LOP_TAIL) {
+    lval* l = lval_list_operand(e, v->cell[1]);
+    if (l == NULL) return NULL;
+
+    lval* x = lval_qexpr();
+    for (int i = 1; i < l->count; i++) lval_add(x, lval_copy(l->cell[i]));
+
+    lval_del(v);
+    return x;
+  }
+
+  // `(eval {...})` evaluates the quoted expression directly
+  if (op == LOP_EVAL && v->cell[1]->type == LVAL_QEXPR) {
+    lval* x = lval_take(v, 1);
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+  }
+
+  return NULL;
+}
+
+// Call sites rewrite themselves the first time they run, into a form for the
+// builtin and argument types they saw. Later runs only check those still hold
+enum {
+  LSITE_GENERIC = -1,
+  LSITE_UNSEEN = 0,
+
+  // Otherwise the `lop` of a binary operation on two numbers, or of
+  // arithmetic on any number of them
+  LSITE_NARY = 0x100,
+};
+
+atomic_long lsite_quickened = 0;
+atomic_long lsite_guard_failures = 0;
+
+static const lbuiltin lop_builtins[] = {
+    [LOP_ADD] = builtin_add, [LOP_SUB] = builtin_sub, [LOP_MUL] = builtin_mul,
+    [LOP_DIV] = builtin_div, [LOP_GT] = builtin_gt,   [LOP_LT] = builtin_lt,
+    [LOP_GE] = builtin_ge,   [LOP_LE] = builtin_le,   [LOP_EQ] = builtin_eq,
+    [LOP_NE] = builtin_ne,
+};
+
+// Sites are allocated in chunks that are never moved, and freed ones are
+// kept on a list for the next read to reuse
+#define LSITE_CHUNK 1024
+
+typedef struct lsite_chunk {
+  struct lsite_chunk* next;
+  int used;
+  lsite sites[LSITE_CHUNK];
+} lsite_chunk;
+
+static lsite_chunk* lsite_chunks = NULL;
+static lsite* lsite_free = NULL;
+static pthread_mutex_t lsite_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread takes sites from the shared ones a batch at a time and keeps
+// those it frees, so reading and deleting lists rarely takes the lock. What a
+// thread still has goes back when it exits
+#define LSITE_BATCH 64
+
+static _Thread_local lsite* lsite_local = NULL;
+
+static pthread_key_t lsite_key;
+static pthread_once_t lsite_once = PTHREAD_ONCE_INIT;
+static _Thread_local int lsite_registered = 0;
+
+static void lsite_release(void* unused) {
+  (void)unused;
+
+  if (lsite_local == NULL) return;
+
+  lsite* last = lsite_local;
+  while (last->next) last = last->next;
+
+  pthread_mutex_lock(&lsite_lock);
+  last->next = lsite_free;
+  lsite_free = lsite_local;
+  pthread_mutex_unlock(&lsite_lock);
+
+  lsite_local = NULL;
+}
+
+static void lsite_init(void) { pthread_key_create(&lsite_key, lsite_release); }
+
+static void lsite_refill(void) {
+  // Any value makes the key's destructor run at thread exit
+  if (!lsite_registered) {
+    pthread_once(&lsite_once, lsite_init);
+    pthread_setspecific(lsite_key, &lsite_registered);
+    lsite_registered = 1;
+  }
+
+  pthread_mutex_lock(&lsite_lock);
+
+  for (int i = 0; i < LSITE_BATCH; i++) {
+    lsite* s = lsite_free;
+
+    if (s) {
+      lsite_free = s->next;
+    } else {
+      if (lsite_chunks == NULL || lsite_chunks->used == LSITE_CHUNK) {
+        lsite_chunk* c = malloc(sizeof(lsite_chunk));
+        c->next = lsite_chunks;
+        c->used = 0;
+        lsite_chunks = c;
+      }
+
+      s = &lsite_chunks->sites[lsite_chunks->used++];
+    }
+
+    s->next = lsite_local;
+    lsite_local = s;
+  }
+
+  pthread_mutex_unlock(&lsite_lock);
+}
+
+lsite* lsite_new(void) {
+  if (lsite_local == NULL) lsite_refill();
+
+  lsite* s = lsite_local;
+  lsite_local = s->next;
+
+  atomic_init(&s->form, LSITE_UNSEEN);
+  atomic_init(&s->refs, 1);
+
+  return s;
+}
+
+lsite* lsite_ref(lsite* s) {
+  if (s) atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+  return s;
+}
+
+void lsite_unref(lsite* s) {
+  if (s == NULL || atomic_fetch_sub(&s->refs, 1) > 1) return;
+
+  s->next = lsite_local;
+  lsite_local = s;
+}
+
+void lsite_cleanup(void) {
+  lsite_free = NULL;
+  lsite_local = NULL;
+
+  while (lsite_chunks) {
+    lsite_chunk* c = lsite_chunks;
+    lsite_chunks = c->next;
+    free(c);
+  }
+}
+
+static int lval_all_nums(lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM) return 0;
+  }
+
+  return 1;
+}
+
+// The specialized form for calling `f` on `a`
+static int lsite_form(lval* f, lval* a) {
+  lop op = lop_of(f->fun);
+  if (!lop_is_binary(op) || !lval_all_nums(a)) return LSITE_GENERIC;
+
+  if (a->count == 2) return op;
+  if (op <= LOP_DIV && a->count > 0) return op | LSITE_NARY;
+
+  return LSITE_GENERIC;
+}
+
+// Call builtin `f` on already evaluated arguments `a` through the form its
+// call site was quickened into. A guard failure turns the site back to the
+// generic path for good. Returns NULL when `lval_call` has to do the call
+lval* lval_call_quick(lval* f, lval* a) {
+  lsite* s = a->site;
+  if (!lval_fast_enabled || s == NULL || f->fun == NULL) return NULL;
+
+  int form = atomic_load_explicit(&s->form, memory_order_relaxed);
+  if (form == LSITE_GENERIC) return NULL;
+
+  if (form == LSITE_UNSEEN) {
+    form = lsite_form(f, a);
+    atomic_store_explicit(&s->form, form, memory_order_relaxed);
+
+    if (form == LSITE_GENERIC) return NULL;
+    atomic_fetch_add_explicit(&lsite_quickened, 1, memory_order_relaxed);
+  }
+
+  lop op = form & ~LSITE_NARY;
+  int nary = form & LSITE_NARY;
+
+  if (f->fun != lop_builtins[op] || (!nary && a->count != 2) ||
+      a->count == 0 || !lval_all_nums(a)) {
+    atomic_fetch_add_explicit(&lsite_guard_failures, 1, memory_order_relaxed);
+    atomic_store_explicit(&s->form, LSITE_GENERIC, memory_order_relaxed);
+    return NULL;
+  }
+
+  // Unary minus
+  long r = a->cell[0]->num;
+  if (op == LOP_SUB && a->count == 1) r = -r;
+
+  // Division by zero is reported by the builtin
+  for (int i = 1; i < a->count; i++) {
+    if (!lop_num(op, r, a->cell[i]->num, &r)) return NULL;
+  }
+
+  lval* x = lval_take(a, 0);
+  x->num = r;
+  return x;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "lval.h"
+
+// Set to 0 to always go through the generic evaluator
+extern int lval_fast_enabled;
+
+// What a call site has been quickened into. Every S-Expression and
+// Q-Expression read from source gets one, shared by all its copies and
+// reused once the last of them is deleted
+struct lsite {
+  atomic_int form;
+  atomic_int refs;
+
+  // Next free site, while on the free list
+  lsite* next;
+};
+
+// Sites quickened so far, and calls that found their site's guess wrong
+extern atomic_long lsite_quickened;
+extern atomic_long lsite_guard_failures;
+
+lsite* lsite_new(void);
+lsite* lsite_ref(lsite* s);
+void lsite_unref(lsite* s);
+void lsite_cleanup(void);
+
+lval* lval_eval_fast(lenv* e, lval* v, lval* f);
+lval* lval_call_quick(lval* f, lval* a);
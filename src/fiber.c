@@ -0,0 +1,327 @@
+// mmap flags and ucontext are not part of strict C17
+#define _DEFAULT_SOURCE
+
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "prof.h"
+
+// Fibers run on their own stacks so the recursive evaluator can be suspended
+// anywhere. The evaluator is deep, so stacks are reserved generously and only
+// touched pages are committed
+#define FIBER_STACK_SIZE (1024 * 1024)
+
+struct lfiber {
+  ucontext_t ctx;
+  void* stack;  // Starts with an inaccessible guard page
+  size_t stack_size;
+  lenv* env;
+  lval* expr;
+  lprof_stack* prof;
+  lfiber_done on_done;
+  void* arg;
+  int done;
+
+  // Either the run queue or the wait list of a channel
+  lfiber* next;
+  lfiber_queue* waiting;
+
+  // Every live fiber, so parked ones can be freed at exit
+  lfiber* all_prev;
+  lfiber* all_next;
+};
+
+static lfiber_queue ready = {0};
+static lfiber* all = NULL;
+static int parked = 0;
+
+// Set at exit, when parked fibers are resumed so they can unwind
+static int cancelled = 0;
+
+// Fiber currently running, `NULL` while in the scheduler (main context)
+static lfiber* current = NULL;
+static ucontext_t scheduler;
+
+static void queue_push(lfiber_queue* q, lfiber* f) {
+  f->next = NULL;
+
+  if (q->tail) {
+    q->tail->next = f;
+  } else {
+    q->head = f;
+  }
+
+  q->tail = f;
+  q->len++;
+}
+
+static lfiber* queue_pop(lfiber_queue* q) {
+  lfiber* f = q->head;
+
+  q->head = f->next;
+  if (q->head == NULL) q->tail = NULL;
+  q->len--;
+
+  return f;
+}
+
+static void queue_remove(lfiber_queue* q, lfiber* f) {
+  lfiber* prev = NULL;
+  for (lfiber* g = q->head; g != f; g = g->next) prev = g;
+
+  if (prev) {
+    prev->next = f->next;
+  } else {
+    q->head = f->next;
+  }
+
+  if (q->tail == f) q->tail = prev;
+  q->len--;
+}
+
+static void fiber_free(lfiber* f) {
+  if (f->env->par) lenv_del(f->env);
+
+  if (f->all_prev) f->all_prev->all_next = f->all_next;
+  if (f->all_next) f->all_next->all_prev = f->all_prev;
+  if (all == f) all = f->all_next;
+
+  munmap(f->stack, f->stack_size);
+  lprof_stack_del(f->prof);
+  free(f);
+}
+
+static void fiber_main(void) {
+  lval* x = lval_eval(current->env, current->expr);
+
+  if (current->on_done) {
+    current->on_done(x, current->arg);
+  } else {
+    // Cancelled fibers were already reported as a deadlock
+    if (x->type == LVAL_ERR && !cancelled) lval_println(x);
+    lval_del(x);
+  }
+
+  current->done = 1;
+
+  // Returning switches to `uc_link`, the scheduler
+}
+
+// Returns 0 without taking `expr` if there was no memory for a stack
+int fiber_spawn(lenv* e, lval* expr, lfiber_done done, void* arg) {
+  // A page below the stack is left inaccessible, so running off the end
+  // faults instead of writing over whatever is mapped there
+  size_t guard = sysconf(_SC_PAGESIZE);
+  void* stack = mmap(NULL, guard + FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) return 0;
+
+  if (mprotect(stack, guard, PROT_NONE) != 0) {
+    munmap(stack, guard + FIBER_STACK_SIZE);
+    return 0;
+  }
+
+  lfiber* f = malloc(sizeof(lfiber));
+
+  // Spawned from inside a function call, whose scope may be gone by the time
+  // the fiber runs. Keep copies of the locals it needs instead
+  if (e->par) e = lenv_closure(e, expr, NULL);
+
+  *f = (lfiber){
+      .stack = stack,
+      .stack_size = guard + FIBER_STACK_SIZE,
+      .env = e,
+      .expr = expr,
+      .prof = lprof_enabled ? lprof_stack_new() : NULL,
+      .on_done = done,
+      .arg = arg,
+      .all_next = all,
+  };
+
+  if (all) all->all_prev = f;
+  all = f;
+
+  // Neighbouring stacks merge into one mapping, which would otherwise get
+  // transparent huge pages and zero 2MB on the first touch of each fiber
+  madvise(f->stack, f->stack_size, MADV_NOHUGEPAGE);
+
+  getcontext(&f->ctx);
+  f->ctx.uc_stack.ss_sp = (char*)f->stack + guard;
+  f->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+  f->ctx.uc_link = &scheduler;
+  makecontext(&f->ctx, fiber_main, 0);
+
+  queue_push(&ready, f);
+
+  return 1;
+}
+
+// Resume every fiber that was ready when the round started, once
+static void fiber_round(void) {
+  for (int n = ready.len; n > 0; n--) {
+    lfiber* f = queue_pop(&ready);
+
+    current = f;
+    lprof_stack* prof = lprof_switch(f->prof);
+
+    swapcontext(&scheduler, &f->ctx);
+
+    lprof_switch(prof);
+    current = NULL;
+
+    if (f->done) fiber_free(f);
+  }
+}
+
+// Switch back to the scheduler. The fiber must already be queued somewhere
+static void fiber_suspend(void) { swapcontext(&current->ctx, &scheduler); }
+
+// Give up the rest of this turn. Outside a fiber, runs one round of the others
+void fiber_yield(void) {
+  if (current) {
+    queue_push(&ready, current);
+    fiber_suspend();
+  } else {
+    fiber_round();
+  }
+}
+
+int fiber_in_fiber(void) { return current != NULL; }
+
+// Number of fibers waiting for their turn, not counting the current one
+int fiber_runnable(void) { return ready.len; }
+
+// Run fibers until they all finish or the rest are parked. Parked fibers stay
+// that way, later top-level expressions may still unblock them
+void fiber_drain(void) {
+  while (current == NULL && ready.len) fiber_round();
+}
+
+// Finish fibers that are still parked. Each one is resumed with every wait
+// failing, so it unwinds like any other error and drops the channels and
+// futures it was holding
+void fiber_cleanup(void) {
+  if (parked) {
+    lval* err = lval_err("Deadlock: %i fibers blocked forever", parked);
+    lval_println(err);
+    lval_del(err);
+  }
+
+  cancelled = 1;
+
+  for (lfiber* f = all; f; f = f->all_next) {
+    if (f->waiting == NULL) continue;
+
+    queue_remove(f->waiting, f);
+    f->waiting = NULL;
+    parked--;
+
+    queue_push(&ready, f);
+  }
+
+  fiber_drain();
+
+  while (all) fiber_free(all);
+}
+
+// Suspend the current fiber on a wait list until it is woken. Returns 0 once
+// fibers are being cancelled, when the caller should give up waiting
+int fiber_park(lfiber_queue* waiters) {
+  if (cancelled) return 0;
+
+  queue_push(waiters, current);
+  current->waiting = waiters;
+  parked++;
+
+  fiber_suspend();
+
+  return 1;
+}
+
+// Move the first fiber on a wait list back to the run queue
+void fiber_wake(lfiber_queue* waiters) {
+  if (waiters->len == 0) return;
+
+  lfiber* f = queue_pop(waiters);
+  f->waiting = NULL;
+  parked--;
+
+  queue_push(&ready, f);
+}
+
+lchan* lchan_new(int cap) {
+  lchan* c = malloc(sizeof(lchan));
+
+  *c = (lchan){
+      .refs = 1,
+      .cap = cap,
+      .buf = malloc(sizeof(lval*) * cap),
+  };
+
+  return c;
+}
+
+lchan* lchan_ref(lchan* c) {
+  c->refs++;
+  return c;
+}
+
+void lchan_unref(lchan* c) {
+  if (--c->refs > 0) return;
+
+  for (int i = 0; i < c->count; i++) {
+    lval_del(c->buf[(c->head + i) % c->cap]);
+  }
+
+  free(c->buf);
+  free(c);
+}
+
+// Block the caller until the channel is ready. Fibers park on the channel;
+// the main context runs the scheduler instead and fails once nothing is left
+// to run
+static int lchan_wait(lchan* c, int room) {
+  while (room ? c->count == c->cap : c->count == 0) {
+    if (current) {
+      if (!fiber_park(room ? &c->senders : &c->receivers)) return 0;
+    } else if (ready.len) {
+      fiber_round();
+    } else {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+lval* lchan_send(lchan* c, lval* v) {
+  if (!lchan_wait(c, 1)) {
+    lval_del(v);
+    return lval_err("Deadlock: 'send' on a full channel");
+  }
+
+  c->buf[(c->head + c->count) % c->cap] = v;
+  c->count++;
+
+  fiber_wake(&c->receivers);
+
+  return lval_sexpr();
+}
+
+lval* lchan_recv(lchan* c) {
+  if (!lchan_wait(c, 0)) {
+    return lval_err("Deadlock: 'recv' on an empty channel");
+  }
+
+  lval* v = c->buf[c->head];
+  c->head = (c->head + 1) % c->cap;
+  c->count--;
+
+  fiber_wake(&c->senders);
+
+  return v;
+}
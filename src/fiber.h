@@ -0,0 +1,44 @@
+#pragma once
+
+#include "lval.h"
+
+typedef struct lfiber lfiber;
+
+typedef struct {
+  lfiber* head;
+  lfiber* tail;
+  int len;
+} lfiber_queue;
+
+// Bounded FIFO of values shared between fibers. Copies of a channel `lval`
+// share the same `lchan`, which is freed when the last copy is deleted
+typedef struct lchan {
+  int refs;
+  int cap;
+  int count;
+  int head;
+  lval** buf;
+
+  // Fibers parked until there is room to send or a value to receive
+  lfiber_queue senders;
+  lfiber_queue receivers;
+} lchan;
+
+lchan* lchan_new(int cap);
+lchan* lchan_ref(lchan* c);
+void lchan_unref(lchan* c);
+
+lval* lchan_send(lchan* c, lval* v);
+lval* lchan_recv(lchan* c);
+
+// Called with the result of a fiber when it finishes. Takes ownership of `x`
+typedef void (*lfiber_done)(lval* x, void* arg);
+
+int fiber_spawn(lenv* e, lval* expr, lfiber_done done, void* arg);
+void fiber_yield(void);
+int fiber_in_fiber(void);
+int fiber_runnable(void);
+int fiber_park(lfiber_queue* waiters);
+void fiber_wake(lfiber_queue* waiters);
+void fiber_drain(void);
+void fiber_cleanup(void);
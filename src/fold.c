@@ -0,0 +1,220 @@
+#include "fold.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "builtin.h"
+#include "jit.h"
+
+int lval_fold_enabled = 1;
+
+// Bumped whenever a global that folding relies on is redefined, so lambda
+// bodies folded before are folded again
+static atomic_uint lval_fold_epoch = 0;
+
+// Builtins whose result only depends on their arguments, and which are cheap
+// enough to run at read time
+static int lbuiltin_is_foldable(lbuiltin f) {
+  return f == builtin_add || f == builtin_sub || f == builtin_mul ||
+         f == builtin_div || f == builtin_list || f == builtin_head ||
+         f == builtin_tail || f == builtin_len || f == builtin_join;
+}
+
+// Builtins that bind names or run code folding can't see
+static int lbuiltin_is_unsafe(lbuiltin f) {
+  return f == builtin_def || f == builtin_assign || f == builtin_eval ||
+         f == builtin_call;
+}
+
+// Builtins that evaluate the Q-Expressions they're given
+static int lbuiltin_runs_args(lbuiltin f) {
+  return f == builtin_if || f == builtin_par || f == builtin_spawn ||
+         f == builtin_future;
+}
+
+static lbuiltin lval_builtin_at(lenv* e, lval* v) {
+  if (v->type != LVAL_SYM) return NULL;
+
+  lval* f = lenv_lookup(e, v->sym);
+  return f && f->type == LVAL_FUN ? f->fun : NULL;
+}
+
+// Whether `sym` is bound in `e` or a scope above it, short of the global one
+static int lenv_binds(lenv* e, char* sym) {
+  for (; e && e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], sym) == 0) return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Values a name can be bound to without keeping what's around it from being
+// folded: ones that can't run code or rebind anything when used
+static int lval_is_inert(lval* x) {
+  switch (x->type) {
+    case LVAL_NUM:
+    case LVAL_STR:
+    case LVAL_ERR:
+      return 1;
+
+    case LVAL_FUN:
+      return x->fun && !lbuiltin_is_unsafe(x->fun);
+
+    // Lists are data. Ones given to something that runs them are caught by
+    // `lval_fold_safe`, without looking through what they hold
+    case LVAL_QEXPR:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+// Whether nothing evaluated as part of `v` can rebind a name or run code that
+// isn't in `v` itself, so folding any call in it gives what running it would.
+// `locals` are the names a lambda body binds when it runs, whose values aren't
+// known yet, and `self` the code of the lambda, which can call itself. At the
+// top level they're NULL, and names that aren't bound yet can't be by the
+// time they're used
+static int lval_fold_safe(lenv* e, lenv* locals, ljit* self, lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) return 1;
+
+  lbuiltin head = v->count ? lval_builtin_at(e, v->cell[0]) : NULL;
+
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i];
+
+    // A call to whatever a list evaluates to
+    if (i == 0 && c->type == LVAL_SEXPR) return 0;
+
+    // Q-Expressions are data unless they're given to something that runs them
+    if (c->type == LVAL_QEXPR && !(head && lbuiltin_runs_args(head))) continue;
+
+    if (c->type != LVAL_SYM) {
+      if (!lval_fold_safe(e, locals, self, c)) return 0;
+      continue;
+    }
+
+    // A local on its own is just its value, but with arguments it's a call
+    if (lenv_binds(locals, c->sym)) {
+      if ((i == 0 && v->count > 1) || (head && lbuiltin_runs_args(head))) {
+        return 0;
+      }
+      continue;
+    }
+
+    lval* x = lenv_lookup(e, c->sym);
+    if (x && x->type == LVAL_FUN && x->fun == NULL && self && x->jit == self)
+      continue;
+
+    if (x && x->type == LVAL_QEXPR && head && lbuiltin_runs_args(head)) {
+      return 0;
+    }
+
+    if (x == NULL ? locals != NULL : !lval_is_inert(x)) return 0;
+  }
+
+  return 1;
+}
+
+void lval_fold_redefine(lval* old, lval* v) {
+  if ((old->type == LVAL_FUN && old->fun) || !lval_is_inert(v)) {
+    atomic_fetch_add(&lval_fold_epoch, 1);
+  }
+}
+
+// Numbers and Q-Expressions evaluate to themselves
+static int lval_is_literal(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_QEXPR;
+}
+
+// Whether `(f args...)` can be replaced by its value. `f` must name a foldable
+// builtin
+static int lval_is_foldable(lenv* e, lval* v) {
+  if (v->count < 2 || v->cell[0]->type != LVAL_SYM) return 0;
+
+  for (int i = 1; i < v->count; i++) {
+    if (!lval_is_literal(v->cell[i])) return 0;
+  }
+
+  lbuiltin f = lval_builtin_at(e, v->cell[0]);
+  return f && lbuiltin_is_foldable(f);
+}
+
+static lval* lval_fold_tree(lenv* e, lval* v) {
+  if (v->type != LVAL_SEXPR) return v;
+
+  // The branches of `if` are code, other Q-Expressions are data
+  lbuiltin head = v->count ? lval_builtin_at(e, v->cell[0]) : NULL;
+
+  lval_own(v);
+
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i];
+
+    if (head == builtin_if && c->type == LVAL_QEXPR) {
+      lval_own(c);
+
+      for (int j = 0; j < c->count; j++) {
+        c->cell[j] = lval_fold_tree(e, c->cell[j]);
+      }
+    } else {
+      v->cell[i] = lval_fold_tree(e, c);
+    }
+  }
+
+  if (!lval_is_foldable(e, v)) return v;
+
+  lval* x = lval_eval(e, lval_copy(v));
+  if (x->type == LVAL_ERR) {
+    lval_del(x);
+    return v;
+  }
+
+  lval_del(v);
+  return x;
+}
+
+// Replace calls to pure builtins on literal arguments with their result,
+// innermost first. Calls that would fail are kept so the error still happens
+// at run time. Nothing is folded in an expression that could change what a
+// name means before the call runs
+lval* lval_fold(lenv* e, lval* v) {
+  if (!lval_fold_enabled || !lval_fold_safe(e, NULL, NULL, v)) return v;
+
+  return lval_fold_tree(e, v);
+}
+
+// The body of lambda `f` as an S-Expression to evaluate in `e`, once its
+// formals are bound there. It's folded on the first call and kept with the lambda's
+// other compiled forms until a global it relies on is redefined. Bodies that
+// call lambdas other than this one or bind names aren't folded at all
+lval* lval_fold_body(lval* f, lenv* e) {
+  ljit* j = f->jit;
+  unsigned epoch = atomic_load(&lval_fold_epoch);
+
+  if (!lval_fold_enabled || j == NULL) {
+    lval* body = lval_copy(f->body);
+    body->type = LVAL_SEXPR;
+    return body;
+  }
+
+  if (j->folded == NULL || j->folded_epoch != epoch) {
+    if (j->folded) lval_del(j->folded);
+
+    lval* body = lval_copy(f->body);
+    body->type = LVAL_SEXPR;
+
+    lenv* root = lenv_root(e);
+    if (lval_fold_safe(root, e, j, body)) {
+      body = lval_fold_tree(root, body);
+    }
+
+    j->folded = body;
+    j->folded_epoch = epoch;
+  }
+
+  return lval_copy(j->folded);
+}
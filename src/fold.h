@@ -0,0 +1,13 @@
+#pragma once
+
+#include "lval.h"
+
+// Set to 0 to evaluate exactly what was read
+extern int lval_fold_enabled;
+
+lval* lval_fold(lenv* e, lval* v);
+lval* lval_fold_body(lval* f, lenv* e);
+
+// Call before the global bound to `old` is bound to `v` instead, for folded
+// lambda bodies that relied on it to be folded again
+void lval_fold_redefine(lval* old, lval* v);
@@ -0,0 +1,124 @@
+#include "future.h"
+
+#include <stdlib.h>
+
+#include "par.h"
+
+// Copy every symbol `v` refers to from `e` into `snapshot`, so a worker never
+// reads the shared environment while the main thread is changing it
+static void lenv_capture(lenv* snapshot, lenv* e, lval* v) {
+  if (v->type == LVAL_SYM) {
+    lval* x = lenv_get(e, v);
+    if (x->type != LVAL_ERR) lenv_put(snapshot, v, x);
+    lval_del(x);
+  }
+
+  if (v->type == LVAL_SEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      lenv_capture(snapshot, e, v->cell[i]);
+    }
+  }
+}
+
+static void lfuture_resolve(lfuture* f, lval* x) {
+  pthread_mutex_lock(&f->lock);
+  f->result = x;
+  atomic_store(&f->done, 1);
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+// Worker pool entry point
+static void lfuture_run(void* arg) {
+  lfuture* f = arg;
+
+  lval* x = lval_eval(f->env, f->expr);
+  lenv_del(f->env);
+
+  lfuture_resolve(f, x);
+  lfuture_unref(f);
+}
+
+// Fiber completion callback
+static void lfuture_finish(lval* x, void* arg) {
+  lfuture* f = arg;
+
+  lfuture_resolve(f, x);
+  while (f->waiters.len) fiber_wake(&f->waiters);
+
+  lfuture_unref(f);
+}
+
+// Pure expressions that are heavy enough go to the worker pool and light ones
+// are evaluated right away, since nothing can observe the difference. Anything
+// else runs as a fiber so it sees the environment like the main context does
+lfuture* lfuture_new(lenv* e, lval* expr) {
+  lfuture* f = malloc(sizeof(lfuture));
+
+  *f = (lfuture){0};
+  atomic_init(&f->refs, 1);
+  atomic_init(&f->done, 0);
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+
+  if (!lval_is_pure(e, expr)) {
+    atomic_fetch_add(&f->refs, 1);
+
+    if (!fiber_spawn(e, expr, lfuture_finish, f)) {
+      atomic_fetch_sub(&f->refs, 1);
+      lval_del(expr);
+      lfuture_resolve(f, lval_err("Could not allocate a fiber stack"));
+    }
+  } else if (lval_weight(expr) < PAR_MIN_WEIGHT) {
+    lfuture_resolve(f, lval_eval(e, expr));
+  } else {
+    f->threaded = 1;
+    f->env = lenv_new();
+    f->expr = expr;
+    lenv_capture(f->env, e, expr);
+
+    atomic_fetch_add(&f->refs, 1);
+    par_submit(lfuture_run, f);
+  }
+
+  return f;
+}
+
+lfuture* lfuture_ref(lfuture* f) {
+  atomic_fetch_add(&f->refs, 1);
+  return f;
+}
+
+void lfuture_unref(lfuture* f) {
+  if (atomic_fetch_sub(&f->refs, 1) > 1) return;
+
+  if (f->result) lval_del(f->result);
+
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+// Wait for the result and return a copy of it. Other fibers keep running
+// while we wait; only when nothing else can run does a worker future block
+lval* lfuture_await(lfuture* f) {
+  while (!atomic_load(&f->done)) {
+    if (!f->threaded && fiber_in_fiber()) {
+      if (!fiber_park(&f->waiters)) break;
+    } else if (fiber_runnable()) {
+      fiber_yield();
+    } else if (f->threaded) {
+      pthread_mutex_lock(&f->lock);
+      while (!atomic_load(&f->done)) pthread_cond_wait(&f->cond, &f->lock);
+      pthread_mutex_unlock(&f->lock);
+    } else {
+      break;
+    }
+  }
+
+  if (!atomic_load(&f->done)) {
+    return lval_err("Deadlock: 'await' on a future that can't finish");
+  }
+
+  return lval_copy(f->result);
+}
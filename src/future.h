@@ -0,0 +1,31 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fiber.h"
+#include "lval.h"
+
+// Result of an expression evaluated in the background. Copies of a future
+// `lval` share the same `lfuture`, which is freed with the last copy
+typedef struct lfuture {
+  atomic_int refs;
+  atomic_int done;
+  lval* result;
+
+  // Futures on the worker pool signal `cond`, fibers wake `waiters`
+  int threaded;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  lfiber_queue waiters;
+
+  // What the worker evaluates, against its own copy of the environment
+  lenv* env;
+  lval* expr;
+} lfuture;
+
+lfuture* lfuture_new(lenv* e, lval* expr);
+lfuture* lfuture_ref(lfuture* f);
+void lfuture_unref(lfuture* f);
+
+lval* lfuture_await(lfuture* f);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "scan.h"
+
+// The grammar in lispy.grammar, compiled by tools/grammar.py at build time
+// into the tables below (target/grammar.c), so the reader starts with nothing
+// to parse, compile or allocate.
+//
+// The reader knows what each rule means, so the rules it's built from are
+// fixed here, and the generator refuses a grammar that doesn't have them.
+// What each of them matches is up to the grammar
+enum {
+  LRULE_NUMBER,
+  LRULE_SYMBOL,
+  LRULE_STRING,
+  LRULE_SEXPR,
+  LRULE_QEXPR,
+  LRULE_COUNT
+};
+
+// Token rules are regexes compiled into deterministic automata. Bytes are
+// first mapped to a class, the same for bytes no automaton tells apart, and
+// each state has a row of successors indexed by class. State 0 is dead and 1
+// is the start. A token ends at the last position where the automaton was in
+// an accepting state. The automata are built to match as mpc's regexes do,
+// where `|`, `?`, `*` and `+` commit to the first way that matches and never
+// give back what they took, so `"abc\"` is no string: the `\"` is taken as
+// an escape and the string never ends. `accept` is 0 for states that don't
+// accept, otherwise one more than the rule matched
+//
+// Where a state loops on some bytes, `run` has the set of them, so a run of
+// those is skipped in one go instead of a lookup at a time
+typedef struct ldfa {
+  const uint8_t* next;
+  const uint8_t* accept;
+  const uint8_t* run;
+} ldfa;
+
+#define LRUN_NONE 255
+
+extern const char* const lgrammar_names[LRULE_COUNT];
+
+extern const int lgrammar_class_count;
+extern const uint8_t lgrammar_bytes[256];
+
+// Automaton of each token rule, empty for lists
+extern const ldfa lgrammar_tokens[LRULE_COUNT];
+
+// Every token rule at once, matching the one `expr` would choose: the first
+// in its order that matches at all
+extern const ldfa lgrammar_choice;
+
+// Brackets of each list rule, zero for tokens
+extern const char lgrammar_open[LRULE_COUNT];
+extern const char lgrammar_close[LRULE_COUNT];
+
+// Alternatives of `expr` in the order they're tried, and for every byte the
+// alternatives that can start with it, one bit per rule. Closing brackets
+// start nothing, so they're told apart without knowing which lists are open,
+// and opening ones start nothing else
+extern const uint8_t lgrammar_order[LRULE_COUNT];
+extern const uint8_t lgrammar_first[256];
+
+#define LFIRST_LISTS (1 << LRULE_SEXPR | 1 << LRULE_QEXPR)
+#define LFIRST_CLOSE (1 << LRULE_COUNT)
+
+// Byte sets for runs. The first is the whitespace skipped after every token
+extern const lbyteset lgrammar_sets[];
+
+#define LGRAMMAR_SPACE 0
@@ -0,0 +1,138 @@
+// mmap flags and fstat are not part of strict C17
+#define _DEFAULT_SOURCE
+
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "serial.h"
+
+// The header, followed by a `serial.h` stream of alternating names and values
+#define LIMAGE_MAGIC "LSPI"
+#define LIMAGE_VERSION 1
+#define LIMAGE_HEADER 5
+
+// Builtins still bound to their own names are left out, since `add_builtins`
+// binds them again before an image is loaded
+static int limage_skip(lenv* e, int i) {
+  lval* v = e->vals[i];
+  if (v->type != LVAL_FUN || v->fun == NULL) return 0;
+
+  char* name = builtin_name(v->fun);
+  return name && strcmp(name, e->syms[i]) == 0;
+}
+
+// Write the global scope of `e` to `path`
+lval* limage_save(lenv* e, char* path) {
+  e = lenv_root(e);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return lval_err("Could not open '%s': %s", path, strerror(errno));
+
+  char header[LIMAGE_HEADER] = LIMAGE_MAGIC;
+  header[LIMAGE_HEADER - 1] = LIMAGE_VERSION;
+
+  lval* err = NULL;
+  if (write(fd, header, sizeof(header)) != sizeof(header)) {
+    err = lval_err("Could not write '%s': %s", path, strerror(errno));
+  }
+
+  lser_writer* w = lser_writer_new(fd);
+
+  for (int i = 0; i < e->count && err == NULL; i++) {
+    if (limage_skip(e, i)) continue;
+
+    lval* k = lval_sym(e->syms[i]);
+    lser_write(w, k);
+    lval_del(k);
+
+    lval* x = lser_write(w, e->vals[i]);
+    if (x) {
+      err = lval_err("Cannot save '%s' in an image: %s", e->syms[i], x->err);
+      lval_del(x);
+    }
+  }
+
+  int ok = lser_writer_del(w);
+  int error = errno;
+  if (close(fd) != 0) ok = 0;
+
+  if (err == NULL && !ok) {
+    err = lval_err("Could not write '%s': %s", path, strerror(error));
+  }
+
+  // Leave nothing half written behind
+  if (err) {
+    unlink(path);
+    return err;
+  }
+
+  return lval_sexpr();
+}
+
+// Bind everything in the image at `path` in the global scope of `e`. The file
+// is mapped and decoded straight from memory
+lval* limage_load(lenv* e, char* path) {
+  e = lenv_root(e);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return lval_err("Could not open '%s': %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < LIMAGE_HEADER) {
+    close(fd);
+    return lval_err("Not a Lispy image");
+  }
+
+  char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return lval_err("Could not map '%s': %s", path, strerror(errno));
+  }
+
+  if (memcmp(base, LIMAGE_MAGIC, LIMAGE_HEADER - 1) != 0 ||
+      base[LIMAGE_HEADER - 1] != LIMAGE_VERSION) {
+    munmap(base, st.st_size);
+    return lval_err("Not a Lispy image");
+  }
+
+  lser_reader* r =
+      lser_reader_mem(base + LIMAGE_HEADER, st.st_size - LIMAGE_HEADER);
+  lval* result = NULL;
+
+  while (result == NULL) {
+    lval* k = lser_read(r, e);
+    if (k == NULL) break;
+
+    lval* v = k->type == LVAL_SYM ? lser_read(r, e) : NULL;
+
+    if (k->type == LVAL_ERR) {
+      result = lval_copy(k);
+    } else if (v == NULL || k->type != LVAL_SYM) {
+      result = lval_err("Corrupt image");
+    } else if (v->type == LVAL_ERR) {
+      result = lval_copy(v);
+    } else if (builtin_named(k->sym)) {
+      lenv_put(e, k, v);
+    } else {
+      // Names in an image are unique, and nothing but builtins is bound yet
+      lenv_append(e, k, v);
+      v = NULL;
+    }
+
+    lval_del(k);
+    if (v) lval_del(v);
+  }
+
+  lser_reader_del(r);
+  munmap(base, st.st_size);
+
+  return result ? result : lval_sexpr();
+}
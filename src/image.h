@@ -0,0 +1,8 @@
+#pragma once
+
+#include "lval.h"
+
+// Snapshots of the global environment. Booting from one binds everything a
+// prelude defined without parsing or evaluating it again
+lval* limage_save(lenv* e, char* path);
+lval* limage_load(lenv* e, char* path);
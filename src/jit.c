@@ -0,0 +1,432 @@
+// mmap flags are not part of strict C17
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "builtin.h"
+
+// Calls before a lambda is compiled, and bail outs before it's given up on
+#define LJIT_THRESHOLD 16
+#define LJIT_MAX_DEOPTS 64
+
+// Arguments are passed to the generated code in an array on the C stack
+#define LJIT_MAX_ARGS 8
+
+enum { LJIT_COUNTING, LJIT_COMPILING, LJIT_COMPILED, LJIT_FAILED };
+
+int ljit_enabled = 1;
+
+// Bumped whenever a builtin is redefined, since generated code assumes `+` is
+// still addition
+static atomic_uint ljit_epoch = 0;
+
+// Code for a lambda, taking ownership of its `formals` and `body`
+ljit* ljit_new(lval* formals, lval* body) {
+  ljit* j = calloc(1, sizeof(ljit));
+  atomic_init(&j->refs, 1);
+  j->formals = formals;
+  j->body = body;
+  if (!ljit_enabled) atomic_init(&j->state, LJIT_FAILED);
+
+  return j;
+}
+
+ljit* ljit_ref(ljit* j) {
+  if (j) atomic_fetch_add(&j->refs, 1);
+  return j;
+}
+
+void ljit_unref(ljit* j) {
+  if (j == NULL || atomic_fetch_sub(&j->refs, 1) > 1) return;
+
+  if (j->code) munmap((void*)j->code, j->size);
+  lval_del(j->formals);
+  lval_del(j->body);
+  if (j->folded) lval_del(j->folded);
+  free(j->slots);
+
+  free(j);
+}
+
+void ljit_invalidate(void) { atomic_fetch_add(&ljit_epoch, 1); }
+
+#if defined(__x86_64__)
+
+// Operations the code generator knows, by the builtin they stand for
+typedef enum {
+  LJIT_OP_NONE,
+  LJIT_OP_ADD,
+  LJIT_OP_SUB,
+  LJIT_OP_MUL,
+  LJIT_OP_DIV,
+  LJIT_OP_GT,
+  LJIT_OP_LT,
+  LJIT_OP_GE,
+  LJIT_OP_LE,
+  LJIT_OP_EQ,
+  LJIT_OP_NE,
+  LJIT_OP_IF,
+} ljit_op;
+
+// Code being generated for the body of `f`
+typedef struct {
+  unsigned char* buf;
+  size_t len;
+  size_t cap;
+
+  // Offsets of the jumps to the bail out path, patched once it's placed
+  size_t* bails;
+  int nbails;
+
+  lenv* root;
+  lval* f;
+} ljit_asm;
+
+static void asm_bytes(ljit_asm* s, const void* bytes, size_t n) {
+  if (s->len + n > s->cap) {
+    while (s->len + n > s->cap) s->cap = s->cap ? s->cap * 2 : 256;
+    s->buf = realloc(s->buf, s->cap);
+  }
+
+  memcpy(s->buf + s->len, bytes, n);
+  s->len += n;
+}
+
+#define ASM(s, ...)                               \
+  do {                                            \
+    const unsigned char bytes_[] = {__VA_ARGS__}; \
+    asm_bytes((s), bytes_, sizeof(bytes_));       \
+  } while (0)
+
+static void asm_u32(ljit_asm* s, uint32_t x) { asm_bytes(s, &x, 4); }
+static void asm_u64(ljit_asm* s, uint64_t x) { asm_bytes(s, &x, 8); }
+
+// Jump whose 32 bit displacement is filled in later, returns its offset
+static size_t asm_rel32(ljit_asm* s) {
+  asm_u32(s, 0);
+  return s->len - 4;
+}
+
+static void asm_patch(ljit_asm* s, size_t at, size_t target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(s->buf + at, &rel, 4);
+}
+
+// Conditional jump, `cc` being the low nibble of the opcode, to the bail out
+static void asm_bail_if(ljit_asm* s, unsigned char cc) {
+  ASM(s, 0x0F, 0x80 | cc);
+
+  s->bails = realloc(s->bails, sizeof(size_t) * (s->nbails + 1));
+  s->bails[s->nbails++] = asm_rel32(s);
+}
+
+#define CC_O 0x0
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+static int ljit_formal(ljit_asm* s, char* sym) {
+  lval* formals = s->f->formals;
+
+  for (int i = 0; i < formals->count; i++) {
+    if (strcmp(formals->cell[i]->sym, sym) == 0) return i;
+  }
+
+  return -1;
+}
+
+// The builtin `sym` names inside the body. It must come from the global scope,
+// not from a formal or a captured local
+static ljit_op ljit_op_of(ljit_asm* s, lval* sym) {
+  if (sym->type != LVAL_SYM || ljit_formal(s, sym->sym) >= 0)
+    return LJIT_OP_NONE;
+
+  lval* x = lenv_lookup(s->f->env, sym->sym);
+  if (x == NULL || x != lenv_lookup(s->root, sym->sym)) return LJIT_OP_NONE;
+  if (x->type != LVAL_FUN || x->fun == NULL) return LJIT_OP_NONE;
+
+  lbuiltin f = x->fun;
+  if (f == builtin_add) return LJIT_OP_ADD;
+  if (f == builtin_sub) return LJIT_OP_SUB;
+  if (f == builtin_mul) return LJIT_OP_MUL;
+  if (f == builtin_div) return LJIT_OP_DIV;
+  if (f == builtin_gt) return LJIT_OP_GT;
+  if (f == builtin_lt) return LJIT_OP_LT;
+  if (f == builtin_ge) return LJIT_OP_GE;
+  if (f == builtin_le) return LJIT_OP_LE;
+  if (f == builtin_eq) return LJIT_OP_EQ;
+  if (f == builtin_ne) return LJIT_OP_NE;
+  if (f == builtin_if) return LJIT_OP_IF;
+  return LJIT_OP_NONE;
+}
+
+static int ljit_emit_sexpr(ljit_asm* s, lval* v);
+
+// Code leaving the value of `v` in rax
+static int ljit_emit(ljit_asm* s, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+      // mov rax, imm64
+      ASM(s, 0x48, 0xB8);
+      asm_u64(s, (uint64_t)v->num);
+      return 1;
+
+    case LVAL_SYM: {
+      int i = ljit_formal(s, v->sym);
+      if (i < 0) return 0;
+
+      // mov rax, [rdi + 8 * i]
+      ASM(s, 0x48, 0x8B, 0x87);
+      asm_u32(s, 8 * i);
+      return 1;
+    }
+
+    case LVAL_SEXPR:
+      return ljit_emit_sexpr(s, v);
+  }
+
+  return 0;
+}
+
+// rax = rax `op` rcx
+static void ljit_emit_op(ljit_asm* s, ljit_op op) {
+  switch (op) {
+    case LJIT_OP_ADD:
+      ASM(s, 0x48, 0x01, 0xC8);  // add rax, rcx
+      asm_bail_if(s, CC_O);
+      break;
+    case LJIT_OP_SUB:
+      ASM(s, 0x48, 0x29, 0xC8);  // sub rax, rcx
+      asm_bail_if(s, CC_O);
+      break;
+    case LJIT_OP_MUL:
+      ASM(s, 0x48, 0x0F, 0xAF, 0xC1);  // imul rax, rcx
+      asm_bail_if(s, CC_O);
+      break;
+    case LJIT_OP_DIV:
+      // Dividing by zero or -1 is left to the interpreter
+      ASM(s, 0x48, 0x85, 0xC9);  // test rcx, rcx
+      asm_bail_if(s, CC_E);
+      ASM(s, 0x48, 0x83, 0xF9, 0xFF);  // cmp rcx, -1
+      asm_bail_if(s, CC_E);
+      ASM(s, 0x48, 0x99);              // cqo
+      ASM(s, 0x48, 0xF7, 0xF9);        // idiv rcx
+      break;
+    default: {
+      unsigned char cc = op == LJIT_OP_GT   ? CC_G
+                         : op == LJIT_OP_LT ? CC_L
+                         : op == LJIT_OP_GE ? CC_GE
+                         : op == LJIT_OP_LE ? CC_LE
+                         : op == LJIT_OP_EQ ? CC_E
+                                            : CC_NE;
+
+      ASM(s, 0x48, 0x39, 0xC8);        // cmp rax, rcx
+      ASM(s, 0x0F, 0x90 | cc, 0xC0);  // setcc al
+      ASM(s, 0x0F, 0xB6, 0xC0);        // movzx eax, al
+      break;
+    }
+  }
+}
+
+// Code for `v` evaluated as an S-Expression, the way the interpreter would
+static int ljit_emit_sexpr(ljit_asm* s, lval* v) {
+  if (v->count == 0) return 0;
+
+  // A single value, which can't be a function here
+  if (v->count == 1) return ljit_emit(s, v->cell[0]);
+
+  ljit_op op = ljit_op_of(s, v->cell[0]);
+  if (op == LJIT_OP_NONE) return 0;
+
+  if (op == LJIT_OP_IF) {
+    if (v->count != 4 || v->cell[2]->type != LVAL_QEXPR ||
+        v->cell[3]->type != LVAL_QEXPR)
+      return 0;
+
+    if (!ljit_emit(s, v->cell[1])) return 0;
+
+    ASM(s, 0x48, 0x85, 0xC0);  // test rax, rax
+    ASM(s, 0x0F, 0x84);        // jz else
+    size_t to_else = asm_rel32(s);
+
+    if (!ljit_emit_sexpr(s, v->cell[2])) return 0;
+
+    ASM(s, 0xE9);  // jmp end
+    size_t to_end = asm_rel32(s);
+
+    asm_patch(s, to_else, s->len);
+    if (!ljit_emit_sexpr(s, v->cell[3])) return 0;
+    asm_patch(s, to_end, s->len);
+
+    return 1;
+  }
+
+  // Comparisons take exactly two numbers
+  if (op >= LJIT_OP_GT && v->count != 3) return 0;
+
+  if (!ljit_emit(s, v->cell[1])) return 0;
+
+  // Unary minus
+  if (op == LJIT_OP_SUB && v->count == 2) {
+    ASM(s, 0x48, 0xF7, 0xD8);  // neg rax
+    asm_bail_if(s, CC_O);
+    return 1;
+  }
+
+  for (int i = 2; i < v->count; i++) {
+    ASM(s, 0x50);  // push rax
+    if (!ljit_emit(s, v->cell[i])) return 0;
+    ASM(s, 0x48, 0x89, 0xC1);  // mov rcx, rax
+    ASM(s, 0x58);              // pop rax
+
+    ljit_emit_op(s, op);
+  }
+
+  return 1;
+}
+
+// Generate `int code(const long* args, long* result)` for the body of `f`
+static int ljit_compile(ljit* j, lenv* e, lval* f) {
+  if (f->formals->count > LJIT_MAX_ARGS) return 0;
+
+  for (int i = 0; i < f->formals->count; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") == 0) return 0;
+  }
+
+  // Globals are looked up in the caller's global scope
+  f->env->par = lenv_root(e);
+
+  ljit_asm s = {.root = f->env->par, .f = f};
+
+  // push rbp; mov rbp, rsp. Bailing out restores rsp from rbp, whatever was
+  // pushed in between
+  ASM(&s, 0x55, 0x48, 0x89, 0xE5);
+
+  int ok = ljit_emit_sexpr(&s, f->body);
+
+  // mov [rsi], rax; mov eax, 1; mov rsp, rbp; pop rbp; ret
+  ASM(&s, 0x48, 0x89, 0x06, 0xB8, 0x01, 0x00, 0x00, 0x00);
+  ASM(&s, 0x48, 0x89, 0xEC, 0x5D, 0xC3);
+
+  // xor eax, eax; mov rsp, rbp; pop rbp; ret
+  for (int i = 0; i < s.nbails; i++) asm_patch(&s, s.bails[i], s.len);
+  ASM(&s, 0x31, 0xC0, 0x48, 0x89, 0xEC, 0x5D, 0xC3);
+
+  // Written while writable, then only ever executable
+  void* code = MAP_FAILED;
+  if (ok) {
+    code = mmap(NULL, s.len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (code != MAP_FAILED) {
+    memcpy(code, s.buf, s.len);
+
+    if (mprotect(code, s.len, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, s.len);
+      code = MAP_FAILED;
+    }
+  }
+
+  free(s.buf);
+  free(s.bails);
+
+  if (code == MAP_FAILED) return 0;
+
+  j->code = (int (*)(const long*, long*))code;
+  j->size = s.len;
+  j->nformals = f->formals->count;
+  j->epoch = atomic_load(&ljit_epoch);
+
+  return 1;
+}
+
+#else
+
+static int ljit_compile(ljit* j, lenv* e, lval* f) { return 0; }
+
+#endif
+
+// Evaluate `v`, a call to `f`, with generated code if `f` has any. Otherwise
+// count the call, and compile `f` once it's hot. Returns NULL when the
+// interpreter should handle the call as usual
+lval* ljit_eval(lenv* e, lval* v, lval* f) {
+  if (f->type != LVAL_FUN || f->fun || f->jit == NULL) return NULL;
+
+  ljit* j = f->jit;
+  int state = atomic_load(&j->state);
+
+  if (state == LJIT_COUNTING) {
+    if (atomic_fetch_add(&j->calls, 1) + 1 < LJIT_THRESHOLD) return NULL;
+
+    // Only one caller compiles, the others keep interpreting meanwhile
+    int expected = LJIT_COUNTING;
+    if (!atomic_compare_exchange_strong(&j->state, &expected, LJIT_COMPILING))
+      return NULL;
+
+    state = ljit_compile(j, e, f) ? LJIT_COMPILED : LJIT_FAILED;
+    atomic_store(&j->state, state);
+  }
+
+  if (state != LJIT_COMPILED) return NULL;
+
+  if (j->epoch != atomic_load(&ljit_epoch)) {
+    atomic_store(&j->state, LJIT_FAILED);
+    return NULL;
+  }
+
+  if (v->count - 1 != j->nformals || f->formals->count != j->nformals)
+    return NULL;
+
+  // Evaluating the arguments may redefine `f`
+  ljit_ref(j);
+
+  for (int i = 1; i < v->count; i++) {
+    v->cell[i] = lval_eval(e, v->cell[i]);
+  }
+
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_ERR) {
+      ljit_unref(j);
+      return lval_take(v, i);
+    }
+  }
+
+  long args[LJIT_MAX_ARGS];
+  int numbers = 1;
+
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_NUM) numbers = 0;
+    if (numbers) args[i - 1] = v->cell[i]->num;
+  }
+
+  long r;
+  if (numbers && j->code(args, &r)) {
+    ljit_unref(j);
+    lval_del(v);
+    return lval_num(r);
+  }
+
+  // Bail out to the interpreter, for good if it keeps happening
+  if (atomic_fetch_add(&j->deopts, 1) + 1 >= LJIT_MAX_DEOPTS) {
+    atomic_store(&j->state, LJIT_FAILED);
+  }
+
+  lval* g = lval_lambda(lenv_root(e), lval_copy(j->formals),
+                        lval_copy(j->body));
+  ljit_unref(j);
+
+  lval_del(lval_pop(v, 0));
+  lval* x = lval_call(e, g, v);
+  lval_del(g);
+
+  return x;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "lval.h"
+
+// Native code for lambdas whose body only does fixnum arithmetic and
+// comparisons on its formals. After `LJIT_THRESHOLD` calls the body is
+// compiled to x86-64, and later calls with number arguments run that instead
+// of the interpreter. Overflow, division by zero or a non-number argument
+// bail out to the interpreter, which gives the usual result or error.
+//
+// Copies of a lambda share the same `ljit`, which is freed with the last copy.
+// With code generation off it's still there, holding the lambda's formals,
+// body and what's resolved from them.
+// Partial applications take fewer arguments, so each gets its own
+typedef struct ljit {
+  atomic_int refs;
+  atomic_int calls;
+  atomic_int deopts;
+  atomic_int state;
+
+  // Generated code returns 0 when it has to bail out
+  int (*code)(const long* args, long* result);
+  size_t size;
+  int nformals;
+  unsigned epoch;
+
+  // The lambda's formals and body, which its copies share and the
+  // interpreter falls back to
+  lval* formals;
+  lval* body;
+
+  // The body with its constant calls folded, which the interpreter runs
+  // instead of the one written, and the `lval_fold_invalidate` epoch it's for
+  lval* folded;
+  unsigned folded_epoch;
+
+  // Where a call binds each formal in its environment, resolved when the
+  // lambda is made. NULL when they're bound one by one, with `&`
+  int* slots;
+  int nslots;
+} ljit;
+
+// Set to 0 to never generate code, e.g. where executable memory is off limits
+extern int ljit_enabled;
+
+ljit* ljit_new(lval* formals, lval* body);
+ljit* ljit_ref(ljit* j);
+void ljit_unref(ljit* j);
+void ljit_invalidate(void);
+
+lval* ljit_eval(lenv* e, lval* v, lval* f);
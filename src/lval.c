@@ -1,12 +1,92 @@
 #include "lval.h"
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "fast.h"
+#include "fiber.h"
+#include "fold.h"
+#include "future.h"
+#include "jit.h"
+#include "map.h"
+#include "prof.h"
+#include "stats.h"
+#include "view.h"
+
+// Most values are temporaries that die as soon as the enclosing call returns,
+// so freed cells are kept on a per-thread free list and handed out again
+// instead of going back to malloc. ASan builds skip the list so it can still
+// catch use after free
+#if defined(__SANITIZE_ADDRESS__)
+#define LVAL_POOL_MAX 0
+#else
+#define LVAL_POOL_MAX 4096
+#endif
+
+static _Thread_local lval* lval_pool = NULL;
+static _Thread_local int lval_pool_size = 0;
+
+// Worker threads come and go with every `par` and parallel read, so a
+// thread's list is given back to malloc when the thread exits
+static pthread_key_t lval_pool_key;
+static pthread_once_t lval_pool_once = PTHREAD_ONCE_INIT;
+static _Thread_local int lval_pool_registered = 0;
+
+static void lval_pool_drain(void* unused) {
+  (void)unused;
+
+  while (lval_pool) {
+    lval* v = lval_pool;
+    lval_pool = (lval*)v->cell;
+    free(v);
+  }
+
+  lval_pool_size = 0;
+}
+
+static void lval_pool_init(void) {
+  pthread_key_create(&lval_pool_key, lval_pool_drain);
+}
+
+static lval* lval_alloc(int type) {
+  lstats_alloc(type);
+
+  lval* v = lval_pool;
+  if (v == NULL) return malloc(sizeof(lval));
+
+  // Free cells link through their first cell pointer
+  lval_pool = (lval*)v->cell;
+  lval_pool_size--;
+  lstats_reuse();
+
+  return v;
+}
+
+static void lval_free(lval* v) {
+  lstats_free();
+
+  if (lval_pool_size >= LVAL_POOL_MAX) {
+    free(v);
+    return;
+  }
+
+  // Any value makes the key's destructor run at thread exit
+  if (!lval_pool_registered) {
+    pthread_once(&lval_pool_once, lval_pool_init);
+    pthread_setspecific(lval_pool_key, &lval_pool_registered);
+    lval_pool_registered = 1;
+  }
+
+  v->cell = (lval**)lval_pool;
+  lval_pool = v;
+  lval_pool_size++;
+}
+
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_NUM);
 
   *v = (lval){
       .type = LVAL_NUM,
@@ -17,7 +97,7 @@ lval* lval_num(long x) {
 }
 
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_ERR);
   v->type = LVAL_ERR;
 
   // Create a VA list and initialize it
@@ -26,10 +106,12 @@ lval* lval_err(char* fmt, ...) {
 
   // Allocate 512 bytes as buffer for the copy
   v->err = malloc(512);
+  lstats_bytes(512);
   vsnprintf(v->err, 511, fmt, va);
 
   // Reallocate to fit
   v->err = realloc(v->err, strlen(v->err) + 1);
+  lstats_realloc(strlen(v->err) + 1);
 
   // Clean up the VA list
   va_end(va);
@@ -38,37 +120,55 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_sym(char* sym) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_SYM);
 
   v->type = LVAL_SYM;
   v->sym = malloc(strlen(sym) + 1);
+  lstats_bytes(strlen(sym) + 1);
   strcpy(v->sym, sym);
 
   return v;
 }
 
+lval* lval_str(char* str) {
+  lval* v = lval_alloc(LVAL_STR);
+
+  v->type = LVAL_STR;
+  v->str = malloc(strlen(str) + 1);
+  lstats_bytes(strlen(str) + 1);
+  strcpy(v->str, str);
+
+  return v;
+}
+
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_SEXPR);
 
   v->type = LVAL_SEXPR;
   v->count = 0;
+  v->cap = 0;
+  v->off = 0;
   v->cell = NULL;
+  v->site = NULL;
 
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_QEXPR);
 
   v->type = LVAL_QEXPR;
   v->count = 0;
+  v->cap = 0;
+  v->off = 0;
   v->cell = NULL;
+  v->site = NULL;
 
   return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_FUN);
 
   v->type = LVAL_FUN;
   v->fun = func;
@@ -76,6 +176,95 @@ lval* lval_fun(lbuiltin func) {
   return v;
 }
 
+// Resolve the formals of a lambda to the bindings of a call's environment.
+// A name given twice is bound once, to the last argument for it, as
+// `lenv_put` would. Formals with `&` are left to be bound one by one
+static void ljit_resolve(ljit* j) {
+  lval* formals = j->formals;
+
+  j->slots = malloc(sizeof(int) * (formals->count + 1));
+  j->nslots = 0;
+
+  for (int i = 0; i < formals->count; i++) {
+    char* sym = formals->cell[i]->sym;
+
+    if (strcmp(sym, "&") == 0) {
+      free(j->slots);
+      j->slots = NULL;
+      return;
+    }
+
+    int slot = -1;
+    for (int k = 0; slot < 0 && k < i; k++) {
+      if (strcmp(formals->cell[k]->sym, sym) == 0) slot = j->slots[k];
+    }
+
+    j->slots[i] = slot >= 0 ? slot : j->nslots++;
+  }
+}
+
+// Lambda over environment `env`, taking ownership of all three
+static lval* lval_closure(lenv* env, lval* formals, lval* body) {
+  lval* v = lval_alloc(LVAL_FUN);
+  ljit* j = ljit_new(formals, body);
+  ljit_resolve(j);
+
+  *v = (lval){
+      .type = LVAL_FUN,
+      .fun = NULL,
+      .env = env,
+      .formals = j->formals,
+      .body = j->body,
+      .jit = j,
+  };
+
+  return v;
+}
+
+// User defined function. Locals of `e` that `body` refers to are copied into
+// the lambda's own environment, so it keeps working after `e` is gone
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+  return lval_closure(lenv_closure(e, body, formals), formals, body);
+}
+
+lval* lval_chan(lchan* c) {
+  lval* v = lval_alloc(LVAL_CHAN);
+
+  v->type = LVAL_CHAN;
+  v->chan = c;
+
+  return v;
+}
+
+lval* lval_fut(lfuture* f) {
+  lval* v = lval_alloc(LVAL_FUT);
+
+  v->type = LVAL_FUT;
+  v->fut = f;
+
+  return v;
+}
+
+lval* lval_map(lmap* m) {
+  lval* v = lval_alloc(LVAL_MAP);
+
+  v->type = LVAL_MAP;
+  v->map = m;
+
+  return v;
+}
+
+lval* lval_view(lview* m, const lview_node* nodes, int count) {
+  lval* v = lval_alloc(LVAL_VIEW);
+
+  v->type = LVAL_VIEW;
+  v->view = m;
+  v->nodes = nodes;
+  v->count = count;
+
+  return v;
+}
+
 char* ltype_name(int t) {
   switch (t) {
     case LVAL_FUN:
@@ -90,128 +279,177 @@ char* ltype_name(int t) {
       return "S-Expression";
     case LVAL_QEXPR:
       return "Q-Expression";
+    case LVAL_CHAN:
+      return "Channel";
+    case LVAL_FUT:
+      return "Future";
+    case LVAL_MAP:
+      return "Map";
+    case LVAL_STR:
+      return "String";
+    case LVAL_VIEW:
+      return "View";
     default:
       return "Unknown";
   }
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+// The cells of a list are allocated after this header, so copies of the list
+// can share them until one of them changes what it holds
+typedef struct {
+  atomic_int refs;
+  int unused;
+} lcells;
 
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+static lcells* lval_cells(lval* v) {
+  return v->cell ? (lcells*)(v->cell - v->off) - 1 : NULL;
+}
+
+// Drop `v`'s hold on its cells. The last list holding them deletes them
+static void lval_unshare(lval* v) {
+  lcells* h = lval_cells(v);
+  if (h == NULL || atomic_fetch_sub(&h->refs, 1) > 1) return;
 
-    if (i != (v->count - 1)) putchar(' ');
+  for (int i = 0; i < v->count; i++) {
+    lval_del(v->cell[i]);
   }
 
-  putchar(close);
+  free(h);
 }
 
-void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_ERR:
-      printf("Error: %s", v->err);
-      break;
-    case LVAL_NUM:
-      printf("%li", v->num);
-      break;
-    case LVAL_SYM:
-      printf("%s", v->sym);
-      break;
-    case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')');
-      break;
-    case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}');
-      break;
-    case LVAL_FUN:
-      printf("<function>");
-      break;
-  }
-}
+// Give list `v` cells of its own, copies of the ones it shares if it does.
+// Anything that changes which cells a list holds, or changes one of them in
+// place, calls this first
+lval* lval_own(lval* v) {
+  lcells* h = lval_cells(v);
+  if (h == NULL || atomic_load(&h->refs) == 1) return v;
 
-void lval_println(lval* v) {
-  lval_print(v);
-  putchar('\n');
-}
+  lcells* n = malloc(sizeof(lcells) + sizeof(lval*) * v->count);
+  lstats_bytes(sizeof(lcells) + sizeof(lval*) * v->count);
+  atomic_init(&n->refs, 1);
 
-static void lval_debug(lval* v) {
-  printf("[DEBUG]: ");
-  lval_print(v);
-  putchar('\n');
-}
+  lval** cell = (lval**)(n + 1);
+  for (int i = 0; i < v->count; i++) {
+    cell[i] = lval_copy(v->cell[i]);
+  }
 
-lval* lval_read_num(mpc_ast_t* t) {
-  // `strtol` uses a global variable, `errno`, for some reason
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
+  lval_unshare(v);
+  v->cell = cell;
+  v->off = 0;
+  v->cap = v->count;
 
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+  return v;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number")) return lval_read_num(t);
-  if (strstr(t->tag, "symbol")) return lval_sym(t->contents);
+static int lval_shared(lval* v) {
+  lcells* h = lval_cells(v);
+  return h && atomic_load(&h->refs) > 1;
+}
 
-  // If root (>) or sexpr then create an empty list
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) x = lval_sexpr();
-  if (strstr(t->tag, "sexpr")) x = lval_sexpr();
-  if (strstr(t->tag, "qexpr")) x = lval_qexpr();
+// Make room for at least `n` cells. Capacity grows geometrically so building
+// a list one cell at a time is linear overall
+static void lval_reserve(lval* v, int n) {
+  lval_own(v);
+  if (v->off + n <= v->cap) return;
+
+  lval** base = v->cell - v->off;
+
+  // Space popped off the front is taken back once it's as much as the list
+  // still holds, so moving the cells down is paid for by the pops
+  if (v->off && v->off >= v->count) {
+    memmove(base, v->cell, sizeof(lval*) * v->count);
+    v->cell = base;
+    v->off = 0;
+    if (n <= v->cap) return;
+  }
 
-  // Fill this list with any valid expressions
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) continue;
-    if (strcmp(t->children[i]->contents, ")") == 0) continue;
-    if (strcmp(t->children[i]->contents, "{") == 0) continue;
-    if (strcmp(t->children[i]->contents, "}") == 0) continue;
-    if (strcmp(t->children[i]->tag, "regex") == 0) continue;
+  int cap = v->cap ? v->cap : 4;
+  while (cap < v->off + n) cap *= 2;
 
-    x = lval_add(x, lval_read(t->children[i]));
-  }
+  lcells* h = realloc(lval_cells(v), sizeof(lcells) + sizeof(lval*) * cap);
+  lstats_realloc(sizeof(lcells) + sizeof(lval*) * cap);
+  if (v->cell == NULL) atomic_init(&h->refs, 1);
 
-  return x;
+  v->cell = (lval**)(h + 1) + v->off;
+  v->cap = cap;
 }
 
 lval* lval_add(lval* v, lval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count - 1] = x;
+  lval_reserve(v, v->count + 1);
+  v->cell[v->count++] = x;
 
   return v;
 }
 
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
+  lstats_copy();
+
+  lval* x = lval_alloc(v->type);
   x->type = v->type;
 
   switch (v->type) {
     case LVAL_FUN:
       x->fun = v->fun;
+
+      if (v->fun == NULL) {
+        // Copies share their code and environment, calls don't change either
+        x->env = lenv_ref(v->env);
+        x->formals = v->formals;
+        x->body = v->body;
+        x->jit = ljit_ref(v->jit);
+      }
       break;
 
     case LVAL_NUM:
       x->num = v->num;
       break;
 
+    case LVAL_CHAN:
+      x->chan = lchan_ref(v->chan);
+      break;
+
+    case LVAL_FUT:
+      x->fut = lfuture_ref(v->fut);
+      break;
+
+    case LVAL_MAP:
+      x->map = lmap_ref(v->map);
+      break;
+
+    case LVAL_VIEW:
+      x->view = lview_ref(v->view);
+      x->nodes = v->nodes;
+      x->count = v->count;
+      break;
+
     case LVAL_ERR:
       x->err = malloc(strlen(v->err) + 1);
+      lstats_bytes(strlen(v->err) + 1);
       strcpy(x->err, v->err);
       break;
 
     case LVAL_SYM:
       x->sym = malloc(strlen(v->sym) + 1);
+      lstats_bytes(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
       break;
 
+    case LVAL_STR:
+      x->str = malloc(strlen(v->str) + 1);
+      lstats_bytes(strlen(v->str) + 1);
+      strcpy(x->str, v->str);
+      break;
+
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+      // The cells are shared until one of the lists changes them
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      x->cap = v->cap;
+      x->off = v->off;
+      x->cell = v->cell;
+      x->site = lsite_ref(v->site);
 
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
-      }
+      if (x->cell) atomic_fetch_add(&lval_cells(x)->refs, 1);
 
       break;
   }
@@ -219,7 +457,173 @@ lval* lval_copy(lval* v) {
   return x;
 }
 
+// Environment for a call to lambda `f` given all its arguments `a`, each bound
+// where `ljit_resolve` put it. Takes ownership of the arguments
+static lenv* lenv_bind(lval* f, lval* a) {
+  ljit* j = f->jit;
+  lenv* e = lenv_new();
+
+  e->par = f->env;
+  e->count = j->nslots;
+  e->syms = malloc(sizeof(char*) * j->nslots);
+  e->vals = calloc(j->nslots, sizeof(lval*));
+  lstats_bytes((sizeof(char*) + sizeof(lval*)) * j->nslots);
+
+  for (int i = 0; i < a->count; i++) {
+    int slot = j->slots[i];
+
+    if (e->vals[slot]) {
+      lval_del(e->vals[slot]);
+    } else {
+      char* sym = f->formals->cell[i]->sym;
+      e->syms[slot] = malloc(strlen(sym) + 1);
+      strcpy(e->syms[slot], sym);
+    }
+
+    e->vals[slot] = a->cell[i];
+  }
+
+  a->count = 0;
+  lval_del(a);
+
+  return e;
+}
+
+// Call `f` with arguments `a`. Lambdas given fewer arguments than they take
+// return a new lambda with those bound, given `& rest` they collect the
+// remaining arguments into a Q-Expression
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  if (f->fun) {
+    if (lview_mapped && !lview_aware(f->fun)) {
+      a = lview_args(a);
+      if (a->type == LVAL_ERR) return a;
+    }
+
+    return f->fun(e, a);
+  }
+
+  // Arguments are moved out of `a`
+  lval_own(a);
+
+  int given = a->count;
+  int total = f->formals->count;
+
+  // Globals are looked up in the caller's global scope
+  f->env->par = lenv_root(e);
+
+  // Given all its arguments, the call gets an environment of its own on top of
+  // the lambda's, with them bound straight into their slots
+  if (f->jit->slots && given == total) {
+    lenv* c = lenv_bind(f, a);
+    lval* x = lval_eval(c, lval_fold_body(f, c));
+    lenv_del(c);
+
+    return x;
+  }
+
+  // Otherwise they're bound one by one into the lambda's own environment,
+  // which its copies no longer share
+  f->env = lenv_own(f->env);
+  lval* formals = lval_copy(f->formals);
+
+  for (int i = 0; i < a->count; i++) {
+    if (formals->count == 0) {
+      lval_del(formals);
+      lval_del(a);
+      return lval_err(
+          "Function passed too many arguments. "
+          "Got %i, Expected %i.",
+          given, total);
+    }
+
+    lval* sym = lval_pop(formals, 0);
+
+    // Variadic: bind everything left as a list
+    if (strcmp(sym->sym, "&") == 0) {
+      if (formals->count != 1) {
+        lval_del(formals);
+        lval_del(sym);
+        lval_del(a);
+        return lval_err(
+            "Function format invalid. "
+            "Symbol '&' not followed by single symbol.");
+      }
+
+      // Move the remaining arguments over
+      lval* rest = lval_qexpr();
+      for (int j = i; j < a->count; j++) lval_add(rest, a->cell[j]);
+      a->count = i;
+
+      lval* nsym = lval_pop(formals, 0);
+      lenv_put(f->env, nsym, rest);
+
+      lval_del(sym);
+      lval_del(nsym);
+      lval_del(rest);
+      break;
+    }
+
+    lenv_put(f->env, sym, a->cell[i]);
+    lval_del(sym);
+  }
+
+  lval_del(a);
+
+  // `&` with nothing left for it binds an empty list
+  if (formals->count > 0 && strcmp(formals->cell[0]->sym, "&") == 0) {
+    if (formals->count != 2) {
+      lval_del(formals);
+      return lval_err(
+          "Function format invalid. "
+          "Symbol '&' not followed by single symbol.");
+    }
+
+    lval_del(lval_pop(formals, 0));
+
+    lval* sym = lval_pop(formals, 0);
+    lval* val = lval_qexpr();
+
+    lenv_put(f->env, sym, val);
+
+    lval_del(sym);
+    lval_del(val);
+  }
+
+  // Partially applied. Code compiled for the lambda it came from takes a
+  // different number of arguments, so it counts and compiles on its own
+  if (formals->count > 0) {
+    return lval_closure(lenv_ref(f->env), formals, lval_copy(f->body));
+  }
+
+  lval_del(formals);
+  return lval_eval(f->env, lval_fold_body(f, f->env));
+}
+
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  const char* name = NULL;
+
+  // Cells are replaced by their values in place
+  lval_own(v);
+
+  // Look the function up once. Common forms are evaluated without evaluating
+  // their arguments one by one
+  if (v->count > 0 && v->cell[0]->type == LVAL_SYM) {
+    lval* f = lenv_lookup(e, v->cell[0]->sym);
+    if (f) {
+      lval* x = lval_eval_fast(e, v, f);
+      if (x) return x;
+
+      x = ljit_eval(e, v, f);
+      if (x) return x;
+
+      // Frames are named after the symbol, which is about to go
+      if (lprof_enabled) name = lprof_name(f, v->cell[0]->sym);
+
+      lval_del(v->cell[0]);
+      v->cell[0] = lval_copy(f);
+    }
+  }
+
   // Eval children
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
@@ -236,7 +640,6 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   // Single expression
   if (v->count == 1) return lval_take(v, 0);
 
-  // More than one child
   // Ensure first element is a function
   lval* f = lval_pop(v, 0);
   if (f->type != LVAL_FUN) {
@@ -246,9 +649,15 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   }
 
   // Call function
-  lval* result = f->fun(e, v);
+  int profiling = lprof_enabled;
+  if (profiling) lprof_push(name ? name : lprof_name(f, NULL));
+
+  lval* result = lval_call_quick(f, v);
+  if (result == NULL) result = lval_call(e, f, v);
   lval_del(f);
 
+  if (profiling) lprof_pop();
+
   return result;
 }
 
@@ -265,35 +674,104 @@ lval* lval_eval(lenv* e, lval* v) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-  // For each cell in 'y' add it to 'x'
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
-  }
+  // Move every cell in 'y' to the end of 'x' in one go
+  lval_own(y);
+  lval_reserve(x, x->count + y->count);
+  memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+
+  x->count += y->count;
+  y->count = 0;
 
   lval_del(y);
   return x;
 }
 
 lval* lval_pop(lval* v, int i) {
+  lval_own(v);
   lval* x = v->cell[i];
 
-  // Shift memory after the item at "i" over the top
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+  if (i == 0) {
+    // The first item is dropped by starting the list one cell later, so
+    // taking the tail or the arguments one by one doesn't shift the rest
+    v->cell++;
+    v->off++;
+  } else {
+    // Shift memory after the item at "i" over the top
+    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+  }
 
+  // Keep the capacity, popping is often followed by more pops or adds
   v->count--;
 
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-
   return x;
 }
 
 lval* lval_take(lval* v, int i) {
-  lval* x = lval_pop(v, i);
+  // Cells shared with other copies stay with them
+  lval* x = lval_shared(v) ? lval_copy(v->cell[i]) : lval_pop(v, i);
   lval_del(v);
 
   return x;
 }
 
+int lval_eq(lval* x, lval* y) {
+  // Views compare equal to the Q-Expressions they hold
+  if (x->type == LVAL_VIEW || y->type == LVAL_VIEW) return lview_eq(x, y);
+
+  if (x->type != y->type) return 0;
+
+  switch (x->type) {
+    case LVAL_NUM:
+      return x->num == y->num;
+
+    case LVAL_ERR:
+      return strcmp(x->err, y->err) == 0;
+
+    case LVAL_SYM:
+      return strcmp(x->sym, y->sym) == 0;
+
+    case LVAL_STR:
+      return strcmp(x->str, y->str) == 0;
+
+    case LVAL_FUN:
+      if (x->fun || y->fun) return x->fun == y->fun;
+
+      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (x->count != y->count) return 0;
+
+      for (int i = 0; i < x->count; i++) {
+        if (!lval_eq(x->cell[i], y->cell[i])) return 0;
+      }
+
+      return 1;
+
+    case LVAL_MAP: {
+      if (x->map->count != y->map->count) return 0;
+
+      lmap* m = x->map;
+      for (int i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] < 0) continue;
+
+        lval* v = lmap_get(y->map, m->keys[i]);
+        if (v == NULL || !lval_eq(m->vals[i], v)) return 0;
+      }
+
+      return 1;
+    }
+
+    case LVAL_CHAN:
+      return x->chan == y->chan;
+
+    case LVAL_FUT:
+      return x->fut == y->fut;
+  }
+
+  return 0;
+}
+
 void lval_del(lval* v) {
   switch (v->type) {
     case LVAL_NUM:
@@ -307,59 +785,184 @@ void lval_del(lval* v) {
       free(v->sym);
       break;
 
+    case LVAL_STR:
+      free(v->str);
+      break;
+
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
+      lval_unshare(v);
+      lsite_unref(v->site);
+      break;
+
+    case LVAL_FUN:
+      if (v->fun == NULL) {
+        lenv_del(v->env);
+        ljit_unref(v->jit);
       }
+      break;
 
-      free(v->cell);
+    case LVAL_CHAN:
+      lchan_unref(v->chan);
       break;
 
-    case LVAL_FUN:
+    case LVAL_FUT:
+      lfuture_unref(v->fut);
+      break;
+
+    case LVAL_MAP:
+      lmap_unref(v->map);
+      break;
+
+    case LVAL_VIEW:
+      lview_unref(v->view);
       break;
   }
 
-  free(v);
+  lval_free(v);
 }
 
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
 
   *e = (lenv){
+      .par = NULL,
       .count = 0,
       .syms = NULL,
       .vals = NULL,
   };
+  atomic_init(&e->refs, 1);
 
   return e;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
+lenv* lenv_copy(lenv* e) {
+  lenv* n = malloc(sizeof(lenv));
+
+  *n = (lenv){
+      .par = e->par,
+      .count = e->count,
+      .syms = malloc(sizeof(char*) * e->count),
+      .vals = malloc(sizeof(lval*) * e->count),
+  };
+  atomic_init(&n->refs, 1);
+
   for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
-    }
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[i], e->syms[i]);
+    n->vals[i] = lval_copy(e->vals[i]);
   }
 
-  return lval_err("Unbound symbol '%s'", k->sym);
+  return n;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  // Check if variable already exists
+lenv* lenv_ref(lenv* e) {
+  atomic_fetch_add(&e->refs, 1);
+  return e;
+}
+
+// `e`, or a copy of it if it's shared, to bind names in
+lenv* lenv_own(lenv* e) {
+  if (atomic_load(&e->refs) == 1) return e;
+
+  lenv* n = lenv_copy(e);
+  lenv_del(e);
+
+  return n;
+}
+
+lenv* lenv_root(lenv* e) {
+  while (e->par) e = e->par;
+  return e;
+}
+
+// Index of `sym` in `e` itself, without looking at parents, or -1
+static int lenv_index(lenv* e, char* sym) {
   for (int i = 0; i < e->count; i++) {
-    // and replace if found
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
+    if (strcmp(e->syms[i], sym) == 0) return i;
+  }
+
+  return -1;
+}
+
+static void lenv_capture_locals(lenv* c, lenv* e, lval* v, lval* formals) {
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      lenv_capture_locals(c, e, v->cell[i], formals);
+    }
+  }
+
+  if (v->type != LVAL_SYM || lenv_index(c, v->sym) >= 0) return;
+
+  if (formals) {
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(formals->cell[i]->sym, v->sym) == 0) return;
+    }
+  }
+
+  // Only locals are captured, globals stay shared and are looked up late
+  for (lenv* s = e; s->par; s = s->par) {
+    int i = lenv_index(s, v->sym);
+
+    if (i >= 0) {
+      lenv_put(c, v, s->vals[i]);
       return;
     }
   }
+}
+
+// New environment on top of the global scope, holding copies of the locals of
+// `e` that `body` mentions, other than `formals`. Code is data, so symbols
+// inside nested Q-Expressions count too
+lenv* lenv_closure(lenv* e, lval* body, lval* formals) {
+  lenv* c = lenv_new();
+  c->par = lenv_root(e);
+  lenv_capture_locals(c, e, body, formals);
+
+  return c;
+}
+
+// The value bound to `sym`, without copying it. NULL if it's unbound
+lval* lenv_lookup(lenv* e, char* sym) {
+  for (; e; e = e->par) {
+    int i = lenv_index(e, sym);
+    if (i >= 0) return e->vals[i];
+  }
+
+  return NULL;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  for (; e; e = e->par) {
+    int i = lenv_index(e, k->sym);
+    if (i >= 0) return lval_copy(e->vals[i]);
+  }
+
+  return lval_err("Unbound symbol '%s'", k->sym);
+}
+
+// Define `k` in this environment
+void lenv_put(lenv* e, lval* k, lval* v) {
+  // Check if variable already exists and replace if found
+  int i = lenv_index(e, k->sym);
+  if (i >= 0) {
+    // Generated code relies on builtins keeping their names
+    if (e->vals[i]->type == LVAL_FUN && e->vals[i]->fun) ljit_invalidate();
+
+    // So do folded lambda bodies, and on the values of globals they name
+    if (e->par == NULL) lval_fold_redefine(e->vals[i], v);
+
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    return;
+  }
 
   // Otherwise, allocate space for new entry
   e->count++;
   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
   e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  lstats_realloc(sizeof(lval*) * e->count);
+  lstats_realloc(sizeof(char*) * e->count);
 
   // Copy contents
   e->vals[e->count - 1] = lval_copy(v);
@@ -367,7 +970,26 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   strcpy(e->syms[e->count - 1], k->sym);
 }
 
+// Bind `k` to `v` in `e`, which must not have a binding for it yet, taking
+// ownership of `v`. Skips the search for an existing binding
+void lenv_append(lenv* e, lval* k, lval* v) {
+  e->count++;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  lstats_realloc(sizeof(lval*) * e->count);
+  lstats_realloc(sizeof(char*) * e->count);
+
+  e->vals[e->count - 1] = v;
+  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
+  strcpy(e->syms[e->count - 1], k->sym);
+}
+
+// Define `k` in the global scope
+void lenv_def(lenv* e, lval* k, lval* v) { lenv_put(lenv_root(e), k, v); }
+
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lprof_name_builtin(func, name);
+
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
 
@@ -378,6 +1000,8 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 }
 
 void lenv_del(lenv* e) {
+  if (atomic_fetch_sub(&e->refs, 1) > 1) return;
+
   for (int i = 0; i < e->count; i++) {
     free(e->syms[i]);
     lval_del(e->vals[i]);
@@ -1,9 +1,16 @@
 #pragma once
 
-#include "mpc.h"
+#include <stdatomic.h>
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lchan lchan;
+typedef struct lfuture lfuture;
+typedef struct lmap lmap;
+typedef struct ljit ljit;
+typedef struct lsite lsite;
+typedef struct lview lview;
+typedef struct lview_node lview_node;
 
 // Function pointers for builtins: `lbuiltin`
 // Ex: lval* my_builtin(lenv*, lval*);
@@ -16,44 +23,87 @@ enum {
   LVAL_SEXPR,
   LVAL_QEXPR,
   LVAL_FUN,
+  LVAL_CHAN,
+  LVAL_FUT,
+  LVAL_MAP,
+  LVAL_STR,
+  LVAL_VIEW,
 };
 
 struct lval {
   int type;
+  // Cells popped off the front of a list, still allocated before `cell`. It
+  // sits in what would otherwise be padding
+  int off;
 
   long num;
   char* err;
-  char* sym;
+  // A value is never both, so strings don't make every value bigger
+  union {
+    char* sym;
+    char* str;
+  };
+  // Functions are either builtins or lambdas with their own environment
   lbuiltin fun;
+  lenv* env;
+  lval* formals;
+  lval* body;
+  ljit* jit;
+  lchan* chan;
+  lfuture* fut;
+  // Views read `count` cells in place from a mapped file, in place of the
+  // fields only maps and lists use
+  union {
+    lmap* map;
+    lview* view;
+  };
 
-  // Count and pointer to a list of `lval`
+  // Count, capacity and pointer to a list of `lval`
   int count;
-  lval** cell;
+  int cap;
+  union {
+    lval** cell;
+    const lview_node* nodes;
+  };
+  // Call site of the list, if it was read from source
+  lsite* site;
 };
 
 // Holds variables. Contains the relationship between names (symbols) and values
+// Lookups that miss fall through to the parent, `NULL` for the global scope
 struct lenv {
+  lenv* par;
   int count;
   char** syms;
   lval** vals;
+  // Copies of a lambda share its environment
+  atomic_int refs;
 };
 
 lval* lval_num(long x);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* sym);
+lval* lval_str(char* str);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 lval* lval_fun(lbuiltin func);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
+lval* lval_chan(lchan* c);
+lval* lval_fut(lfuture* f);
+lval* lval_map(lmap* m);
+lval* lval_view(lview* m, const lview_node* nodes, int count);
 char* ltype_name(int t);
 
-void lval_expr_print(lval* v, char open, char close);
+// Defined in print.c
 void lval_print(lval* v);
 void lval_println(lval* v);
+void lval_debug(lval* v);
 
-lval* lval_read_num(mpc_ast_t* t);
-lval* lval_read(mpc_ast_t* t);
 lval* lval_add(lval* v, lval* x);
+lval* lval_copy(lval* v);
+lval* lval_own(lval* v);
 
+lval* lval_call(lenv* e, lval* f, lval* a);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
 
@@ -61,10 +111,19 @@ lval* lval_join(lval* x, lval* y);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 
+int lval_eq(lval* x, lval* y);
 void lval_del(lval* v);
 
 lenv* lenv_new(void);
+lenv* lenv_copy(lenv* e);
+lenv* lenv_ref(lenv* e);
+lenv* lenv_own(lenv* e);
+lenv* lenv_root(lenv* e);
+lenv* lenv_closure(lenv* e, lval* body, lval* formals);
+lval* lenv_lookup(lenv* e, char* sym);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_append(lenv* e, lval* k, lval* v);
+void lenv_def(lenv* e, lval* k, lval* v);
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
 void lenv_del(lenv* e);
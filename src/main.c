@@ -1,65 +1,197 @@
 #include <editline/readline.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "builtin.h"
+#include "fast.h"
+#include "fiber.h"
+#include "fold.h"
+#include "image.h"
+#include "jit.h"
 #include "lval.h"
-#include "mpc.h"
+#include "prof.h"
+#include "read.h"
+#include "scan.h"
+#include "stats.h"
+
+// Evaluate a top-level expression from a file, printing only errors
+static void eval_top(lenv* env, lval* x, int print_folded) {
+  x = lval_fold(env, x);
+  if (print_folded) lval_debug(x);
+
+  x = lval_eval(env, x);
+  if (x->type == LVAL_ERR) lval_println(x);
+  lval_del(x);
+
+  // Let spawned fibers run before moving on
+  fiber_drain();
+}
 
 int main(int argc, char* argv[]) {
-  // Parsers
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* Sexpr = mpc_new("sexpr");
-  mpc_parser_t* Qexpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Lispy = mpc_new("lispy");
-
-  // Grammar
-  mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                  \
-            number : /-?[0-9]+/ ;                              \
-            symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
-            sexpr  : '(' <expr>* ')' ;                         \
-            qexpr  : '{' <expr>* '}' ;                         \
-            expr   : <number> | <symbol> | <sexpr> | <qexpr> ; \
-            lispy  : /^/ <expr>* /$/ ;                         \
-            ",
-            Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-  puts("Lispy Version 0.1");
-  puts("Press ctrl+c to exit\n");
+  // Options
+  int print_folded = 0;
+  int quicken_stats = 0;
+  int read_only = 0;
+  int tokenize = 0;
+  char* profile = NULL;
+  char* stats = NULL;
+  char* image = NULL;
+  char* save_image = NULL;
+  int files = 0;
+
+  // No generated code where executable memory is off limits
+  if (getenv("LISPY_NO_JIT")) ljit_enabled = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-fold") == 0) lval_fold_enabled = 0;
+    if (strcmp(argv[i], "--no-fast") == 0) lval_fast_enabled = 0;
+    if (strcmp(argv[i], "--no-jit") == 0) ljit_enabled = 0;
+    if (strcmp(argv[i], "--no-predict") == 0) lread_predict_enabled = 0;
+    if (strcmp(argv[i], "--no-simd") == 0) lscan_simd_enabled = 0;
+    if (strcmp(argv[i], "--print-folded") == 0) print_folded = 1;
+    if (strcmp(argv[i], "--quicken-stats") == 0) quicken_stats = 1;
+    if (strcmp(argv[i], "--read-only") == 0) read_only = 1;
+    if (strncmp(argv[i], "--read-threads=", 15) == 0) {
+      lread_threads = atoi(argv[i] + 15);
+      if (lread_threads < 1) lread_threads = 1;
+      if (lread_threads > LREAD_MAX_THREADS) lread_threads = LREAD_MAX_THREADS;
+    }
+    if (strcmp(argv[i], "--tokenize") == 0) tokenize = 1;
+    if (strcmp(argv[i], "--profile") == 0) profile = "lispy.folded";
+    if (strncmp(argv[i], "--profile=", 10) == 0) profile = argv[i] + 10;
+    if (strcmp(argv[i], "--stats") == 0) stats = "-";
+    if (strncmp(argv[i], "--stats=", 8) == 0) stats = argv[i] + 8;
+    if (strncmp(argv[i], "--image=", 8) == 0) image = argv[i] + 8;
+    if (strncmp(argv[i], "--save-image=", 13) == 0) save_image = argv[i] + 13;
+    if (strncmp(argv[i], "--", 2) != 0) files++;
+  }
+
+  // Count allocations and copies, written out as JSON at exit. Counting
+  // starts before the builtins are added, so `live` and `frees` include them
+  if (stats) lstats_enabled = 1;
 
   lenv* env = lenv_new();
   add_builtins(env);
 
-  while (1) {
+  // Sample the Lispy call stack, written out in collapsed form at exit
+  if (profile && !lprof_start(profile)) perror("profile");
+
+  // Start from the globals of an earlier run instead of only the builtins
+  if (image) {
+    lval* x = limage_load(env, image);
+    if (x->type == LVAL_ERR) lval_println(x);
+    lval_del(x);
+  }
+
+  // Evaluate every file given on the command line instead of starting a REPL
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0) continue;
+
+    // Standard input is read as it arrives, running each expression in turn
+    if (strcmp(argv[i], "-") == 0) {
+      lstream* s = lstream_new("<stdin>", STDIN_FILENO);
+
+      for (lval* x; (x = lstream_next(s));) {
+        if (x->type == LVAL_ERR || read_only) {
+          if (x->type == LVAL_ERR) lval_println(x);
+          lval_del(x);
+        } else {
+          eval_top(env, x, print_folded);
+        }
+      }
+
+      lstream_del(s);
+      continue;
+    }
+
+    // Only counting tokens, to time the tokenizer on its own
+    if (tokenize) {
+      lval* x = lread_file_tokens(argv[i]);
+      if (x->type == LVAL_ERR) lval_println(x);
+      lval_del(x);
+      continue;
+    }
+
+    lval* program = lread_file(argv[i]);
+    if (program->type == LVAL_ERR) lval_println(program);
+
+    // Only reading, to time the reader on its own
+    if (program->type == LVAL_ERR || read_only) {
+      lval_del(program);
+      continue;
+    }
+
+    // Evaluate each top-level expression on its own
+    for (int j = 0; j < program->count; j++) {
+      eval_top(env, program->cell[j], print_folded);
+    }
+
+    // Every expression was consumed by `lval_eval`
+    program->count = 0;
+    lval_del(program);
+  }
+
+  if (files == 0) {
+    puts("Lispy Version 0.1");
+    puts("Press ctrl+c to exit\n");
+  }
+
+  while (files == 0) {
     // Output prompt and get input
     char* input = readline("lispy> ");
+    if (input == NULL) break;
 
     // Add input to history
     add_history(input);
 
     // Parse
-    mpc_result_t ast;
-    if (mpc_parse("<stdin>", input, Lispy, &ast)) {
-      lval* x = lval_eval(env, lval_read(ast.output));
+    lval* x = lread("<stdin>", input, strlen(input));
 
-      lval_println(x);
-      lval_del(x);
+    if (x->type != LVAL_ERR) {
+      x = lval_fold(env, x);
+      if (print_folded) lval_debug(x);
 
-      mpc_ast_delete(ast.output);
-    } else {
-      mpc_err_print(ast.error);
-      mpc_err_delete(ast.error);
+      x = lval_eval(env, x);
     }
 
+    lval_println(x);
+    lval_del(x);
+
+    fiber_drain();
+
     free(input);
   }
 
-  lenv_del(env);
+  // Snapshot the globals, for a later run to start from with `--image`
+  if (save_image) {
+    lval* x = limage_save(env, save_image);
+    if (x->type == LVAL_ERR) lval_println(x);
+    lval_del(x);
+  }
+
+  if (quicken_stats) {
+    fprintf(stderr, "Quickened %li call sites, %li guard failures\n",
+            atomic_load(&lsite_quickened), atomic_load(&lsite_guard_failures));
+  }
+
+  lprof_stop();
+
+  if (stats) {
+    FILE* out = strcmp(stats, "-") == 0 ? stderr : fopen(stats, "w");
 
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    if (out) {
+      lstats_dump(out);
+      if (out != stderr) fclose(out);
+    } else {
+      perror(stats);
+    }
+  }
+
+  fiber_cleanup();
+  lenv_del(env);
+  lsite_cleanup();
 
   return 0;
 }
@@ -0,0 +1,210 @@
+#include "map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Keep the table at most 7/8 full, tombstones included
+#define LMAP_MAX_LOAD(cap) ((cap) - (cap) / 8)
+
+static uint64_t hash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static uint64_t lval_hash(lval* k) {
+  if (k->type == LVAL_NUM) return hash_mix((uint64_t)k->num);
+
+  // FNV-1a over the symbol name
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (char* c = k->sym; *c; c++) {
+    h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+  }
+
+  return hash_mix(h ^ LVAL_SYM);
+}
+
+static int lval_key_eq(lval* a, lval* b) {
+  if (a->type != b->type) return 0;
+  if (a->type == LVAL_NUM) return a->num == b->num;
+
+  return strcmp(a->sym, b->sym) == 0;
+}
+
+int lmap_can_key(lval* k) { return k->type == LVAL_NUM || k->type == LVAL_SYM; }
+
+static void lmap_alloc(lmap* m, int cap) {
+  m->cap = cap;
+  m->ctrl = malloc(cap);
+  m->keys = malloc(sizeof(lval*) * cap);
+  m->vals = malloc(sizeof(lval*) * cap);
+
+  memset(m->ctrl, CTRL_EMPTY, cap);
+}
+
+lmap* lmap_new(void) {
+  lmap* m = malloc(sizeof(lmap));
+
+  m->count = 0;
+  m->used = 0;
+  atomic_init(&m->refs, 1);
+  lmap_alloc(m, 8);
+
+  return m;
+}
+
+lmap* lmap_ref(lmap* m) {
+  atomic_fetch_add(&m->refs, 1);
+  return m;
+}
+
+void lmap_unref(lmap* m) {
+  if (atomic_fetch_sub(&m->refs, 1) > 1) return;
+
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] < 0) continue;
+
+    lval_del(m->keys[i]);
+    lval_del(m->vals[i]);
+  }
+
+  free(m->ctrl);
+  free(m->keys);
+  free(m->vals);
+  free(m);
+}
+
+// Slot holding `k`, or -1. `h` is the hash of `k`
+static int lmap_find(lmap* m, lval* k, uint64_t h) {
+  int8_t tag = h & 0x7f;
+  int mask = m->cap - 1;
+
+  for (int i = (h >> 7) & mask;; i = (i + 1) & mask) {
+    if (m->ctrl[i] == CTRL_EMPTY) return -1;
+    if (m->ctrl[i] == tag && lval_key_eq(m->keys[i], k)) return i;
+  }
+}
+
+// Store an entry known to be absent, taking ownership of `k` and `v`
+static void lmap_insert(lmap* m, lval* k, lval* v, uint64_t h) {
+  int mask = m->cap - 1;
+
+  int i = (h >> 7) & mask;
+  while (m->ctrl[i] >= 0) i = (i + 1) & mask;
+
+  if (m->ctrl[i] == CTRL_EMPTY) m->used++;
+
+  m->ctrl[i] = h & 0x7f;
+  m->keys[i] = k;
+  m->vals[i] = v;
+  m->count++;
+}
+
+// Rehash into a table sized for the live entries, dropping tombstones
+static void lmap_resize(lmap* m) {
+  int cap = m->cap;
+  while (m->count * 2 >= LMAP_MAX_LOAD(cap)) cap *= 2;
+
+  int8_t* ctrl = m->ctrl;
+  lval** keys = m->keys;
+  lval** vals = m->vals;
+  int old_cap = m->cap;
+
+  m->count = 0;
+  m->used = 0;
+  lmap_alloc(m, cap);
+
+  for (int i = 0; i < old_cap; i++) {
+    if (ctrl[i] < 0) continue;
+    lmap_insert(m, keys[i], vals[i], lval_hash(keys[i]));
+  }
+
+  free(ctrl);
+  free(keys);
+  free(vals);
+}
+
+// Return a map that is safe to change: `m` itself if nobody else holds it,
+// otherwise a private clone. Consumes the caller's reference to `m`
+lmap* lmap_own(lmap* m) {
+  if (atomic_load(&m->refs) == 1) return m;
+
+  lmap* x = malloc(sizeof(lmap));
+
+  x->count = m->count;
+  x->used = m->used;
+  atomic_init(&x->refs, 1);
+  lmap_alloc(x, m->cap);
+  memcpy(x->ctrl, m->ctrl, m->cap);
+
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] < 0) continue;
+
+    x->keys[i] = lval_copy(m->keys[i]);
+    x->vals[i] = lval_copy(m->vals[i]);
+  }
+
+  lmap_unref(m);
+
+  return x;
+}
+
+// Borrowed pointer to the value stored under `k`, or `NULL`
+lval* lmap_get(lmap* m, lval* k) {
+  int i = lmap_find(m, k, lval_hash(k));
+  return i < 0 ? NULL : m->vals[i];
+}
+
+// Store copies of `k` and `v`, replacing any existing value
+void lmap_put(lmap* m, lval* k, lval* v) {
+  uint64_t h = lval_hash(k);
+
+  int i = lmap_find(m, k, h);
+  if (i >= 0) {
+    lval_del(m->vals[i]);
+    m->vals[i] = lval_copy(v);
+    return;
+  }
+
+  if (m->used + 1 > LMAP_MAX_LOAD(m->cap)) lmap_resize(m);
+
+  lmap_insert(m, lval_copy(k), lval_copy(v), h);
+}
+
+int lmap_delete(lmap* m, lval* k) {
+  int i = lmap_find(m, k, lval_hash(k));
+  if (i < 0) return 0;
+
+  lval_del(m->keys[i]);
+  lval_del(m->vals[i]);
+
+  // A slot followed by an empty one can't be in the middle of a probe chain
+  int next = (i + 1) & (m->cap - 1);
+  if (m->ctrl[next] == CTRL_EMPTY) {
+    m->ctrl[i] = CTRL_EMPTY;
+    m->used--;
+  } else {
+    m->ctrl[i] = CTRL_DELETED;
+  }
+
+  m->count--;
+
+  return 1;
+}
+
+lval* lmap_keys(lmap* m) {
+  lval* x = lval_qexpr();
+
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] >= 0) lval_add(x, lval_copy(m->keys[i]));
+  }
+
+  return x;
+}
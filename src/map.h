@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "lval.h"
+
+// Open addressing hash table keyed by numbers and symbols. Each slot has a
+// control byte holding 7 bits of the key's hash, so most probes that miss
+// never touch the key itself.
+//
+// Maps are values: copies share the same `lmap` and whoever changes a shared
+// map gets a private clone first, so lookups through `lenv_get` stay O(1)
+typedef struct lmap {
+  atomic_int refs;
+  int count;
+  int used;  // Live entries plus tombstones
+  int cap;   // Always a power of two
+
+  int8_t* ctrl;
+  lval** keys;
+  lval** vals;
+} lmap;
+
+lmap* lmap_new(void);
+lmap* lmap_ref(lmap* m);
+void lmap_unref(lmap* m);
+lmap* lmap_own(lmap* m);
+
+int lmap_can_key(lval* k);
+lval* lmap_get(lmap* m, lval* k);
+void lmap_put(lmap* m, lval* k, lval* v);
+int lmap_delete(lmap* m, lval* k);
+lval* lmap_keys(lmap* m);
@@ -0,0 +1,202 @@
+#include "par.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "builtin.h"
+
+// Number of nodes in the tree rooted at `v`. Used as a rough cost estimate
+int lval_weight(lval* v) {
+  int weight = 1;
+
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      weight += lval_weight(v->cell[i]);
+    }
+  }
+
+  return weight;
+}
+
+// Builtins that only read their arguments and never touch the environment
+static int lbuiltin_is_pure(lbuiltin f) {
+  return f == builtin_add || f == builtin_sub || f == builtin_mul ||
+         f == builtin_div || f == builtin_list || f == builtin_head ||
+         f == builtin_tail || f == builtin_join || f == builtin_len ||
+         f == builtin_hashmap || f == builtin_get || f == builtin_put ||
+         f == builtin_delete || f == builtin_keys || f == builtin_eq ||
+         f == builtin_ne || f == builtin_gt || f == builtin_lt ||
+         f == builtin_ge || f == builtin_le;
+}
+
+// Channels and futures are shared handles, so values holding them can't be
+// copied from one thread while another copies or deletes them
+static int lval_is_plain(lval* v) {
+  if (v->type == LVAL_CHAN || v->type == LVAL_FUT) return 0;
+
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      if (!lval_is_plain(v->cell[i])) return 0;
+    }
+  }
+
+  return 1;
+}
+
+// An expression is pure when evaluating it can't modify the environment, so
+// several of them can be evaluated against the same `lenv` at once
+int lval_is_pure(lenv* e, lval* v) {
+  switch (v->type) {
+    case LVAL_SYM: {
+      lval* x = lenv_get(e, v);
+      int pure = x->type == LVAL_FUN ? lbuiltin_is_pure(x->fun)
+                                     : lval_is_plain(x);
+      lval_del(x);
+
+      return pure;
+    }
+
+    case LVAL_SEXPR:
+      for (int i = 0; i < v->count; i++) {
+        if (!lval_is_pure(e, v->cell[i])) return 0;
+      }
+
+      return 1;
+
+    default:
+      // Numbers, errors and Q-Expressions are never evaluated
+      return lval_is_plain(v);
+  }
+}
+
+typedef struct {
+  lenv* env;
+  lval** cells;
+  int count;
+  atomic_int next;
+} par_job;
+
+// Workers (including the calling thread) claim cells one at a time until
+// there are none left, so uneven subtrees still balance out
+static void* par_worker(void* arg) {
+  par_job* job = arg;
+
+  int i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    job->cells[i] = lval_eval(job->env, job->cells[i]);
+  }
+
+  return NULL;
+}
+
+// Evaluate every cell in place. Falls back to sequential evaluation unless at
+// least two cells are heavy enough and all of them are pure
+void par_eval_all(lenv* e, lval** cells, int count) {
+  int heavy = 0;
+  int pure = 1;
+
+  for (int i = 0; i < count && pure; i++) {
+    if (lval_weight(cells[i]) >= PAR_MIN_WEIGHT) heavy++;
+    pure = lval_is_pure(e, cells[i]);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus < heavy ? cpus : heavy;
+
+  par_job job = {.env = e, .cells = cells, .count = count};
+  atomic_init(&job.next, 0);
+
+  if (!pure || threads < 2) {
+    par_worker(&job);
+    return;
+  }
+
+  pthread_t workers[threads - 1];
+  int started = 0;
+
+  for (int i = 0; i < threads - 1; i++) {
+    if (pthread_create(&workers[i], NULL, par_worker, &job) != 0) break;
+    started++;
+  }
+
+  par_worker(&job);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+// Background jobs for the worker pool
+typedef struct par_task {
+  void (*fn)(void*);
+  void* arg;
+  struct par_task* next;
+} par_task;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static par_task* pool_head = NULL;
+static par_task* pool_tail = NULL;
+static int pool_started = 0;
+
+static void* pool_worker(void* arg) {
+  while (1) {
+    pthread_mutex_lock(&pool_lock);
+    while (pool_head == NULL) pthread_cond_wait(&pool_wake, &pool_lock);
+
+    par_task* t = pool_head;
+    pool_head = t->next;
+    if (pool_head == NULL) pool_tail = NULL;
+
+    pthread_mutex_unlock(&pool_lock);
+
+    t->fn(t->arg);
+    free(t);
+  }
+
+  return NULL;
+}
+
+// Start one worker per CPU the first time a job is submitted
+static void pool_start(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (long i = 0; i < (cpus > 1 ? cpus : 1); i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, pool_worker, NULL) != 0) break;
+
+    pthread_detach(worker);
+    pool_started++;
+  }
+}
+
+// Run `fn(arg)` on the worker pool. Runs it right away if no worker could be
+// started
+void par_submit(void (*fn)(void*), void* arg) {
+  par_task* t = malloc(sizeof(par_task));
+  *t = (par_task){.fn = fn, .arg = arg};
+
+  pthread_mutex_lock(&pool_lock);
+
+  if (!pool_started) pool_start();
+
+  if (!pool_started) {
+    pthread_mutex_unlock(&pool_lock);
+    free(t);
+    fn(arg);
+    return;
+  }
+
+  if (pool_tail) {
+    pool_tail->next = t;
+  } else {
+    pool_head = t;
+  }
+
+  pool_tail = t;
+
+  pthread_cond_signal(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "lval.h"
+
+// Minimum number of nodes an expression needs before it is worth handing to
+// another thread. Below this, thread startup costs more than the evaluation.
+#define PAR_MIN_WEIGHT 256
+
+int lval_weight(lval* v);
+int lval_is_pure(lenv* e, lval* v);
+
+void par_eval_all(lenv* e, lval** cells, int count);
+void par_submit(void (*fn)(void*), void* arg);
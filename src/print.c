@@ -0,0 +1,287 @@
+#include "print.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "map.h"
+#include "view.h"
+
+void lbuf_init(lbuf* b) {
+  b->data = b->inline_data;
+  b->len = 0;
+  b->cap = LBUF_INLINE;
+}
+
+void lbuf_free(lbuf* b) {
+  if (b->data != b->inline_data) free(b->data);
+  lbuf_init(b);
+}
+
+// Make room for `n` more bytes, at least doubling so appends stay amortized
+// O(1)
+void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->len + n <= b->cap) return;
+
+  size_t cap = b->cap * 2;
+  while (cap < b->len + n) cap *= 2;
+
+  if (b->data == b->inline_data) {
+    b->data = malloc(cap);
+    memcpy(b->data, b->inline_data, b->len);
+  } else {
+    b->data = realloc(b->data, cap);
+  }
+
+  b->cap = cap;
+}
+
+void lbuf_puts(lbuf* b, const char* s) {
+  size_t n = strlen(s);
+
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+// "00" "01" ... "99", so numbers are formatted two digits per division
+static const char lbuf_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+void lbuf_num(lbuf* b, long x) {
+  // Negate as unsigned so `LONG_MIN` works too
+  unsigned long n = x < 0 ? -(unsigned long)x : (unsigned long)x;
+
+  // Digits are produced last to first, into the end of `tmp`
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+
+  while (n >= 100) {
+    const char* d = lbuf_digits + (n % 100) * 2;
+    n /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+
+  if (n >= 10) {
+    const char* d = lbuf_digits + n * 2;
+    *--p = d[1];
+    *--p = d[0];
+  } else {
+    *--p = '0' + n;
+  }
+
+  if (x < 0) *--p = '-';
+
+  size_t len = tmp + sizeof(tmp) - p;
+  lbuf_reserve(b, len);
+  memcpy(b->data + b->len, p, len);
+  b->len += len;
+}
+
+// Hand the contents over as a NUL terminated string owned by the caller. The
+// buffer is left empty
+char* lbuf_take(lbuf* b) {
+  lbuf_putc(b, '\0');
+
+  char* s;
+  if (b->data == b->inline_data) {
+    s = malloc(b->len);
+    memcpy(s, b->data, b->len);
+  } else {
+    s = realloc(b->data, b->len);
+  }
+
+  lbuf_init(b);
+
+  return s;
+}
+
+// Write everything to `fd` and empty the buffer. Anything still sitting in
+// stdout's own buffer goes first, so output stays in order
+int lbuf_flush(lbuf* b, int fd) {
+  if (fd == STDOUT_FILENO) fflush(stdout);
+
+  size_t done = 0;
+  while (done < b->len) {
+    ssize_t n = write(fd, b->data + done, b->len - done);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    done += n;
+  }
+
+  int ok = done == b->len;
+  b->len = 0;
+
+  return ok;
+}
+
+// Characters the reader unescapes, and the letter after their backslash
+static const char lval_escapes[] = "\a\b\f\n\r\t\v\\\"";
+static const char lval_escaped[] = "abfnrtv\\\"";
+
+// Quoted, with the escapes the reader understands
+static void lval_write_str(lbuf* b, char* s) {
+  lbuf_putc(b, '"');
+
+  for (; *s; s++) {
+    char* esc = strchr(lval_escapes, *s);
+
+    if (esc) {
+      lbuf_putc(b, '\\');
+      lbuf_putc(b, lval_escaped[esc - lval_escapes]);
+    } else {
+      lbuf_putc(b, *s);
+    }
+  }
+
+  lbuf_putc(b, '"');
+}
+
+static void lval_write_expr(lbuf* b, lval* v, char open, char close) {
+  lbuf_putc(b, open);
+
+  for (int i = 0; i < v->count; i++) {
+    lval_write(b, v->cell[i]);
+
+    if (i != (v->count - 1)) lbuf_putc(b, ' ');
+  }
+
+  lbuf_putc(b, close);
+}
+
+static void lval_write_map(lbuf* b, lval* v) {
+  lmap* m = v->map;
+  int printed = 0;
+
+  lbuf_puts(b, "#{");
+
+  for (int i = 0; i < m->cap; i++) {
+    if (m->ctrl[i] < 0) continue;
+
+    if (printed++) lbuf_putc(b, ' ');
+
+    lval_write(b, m->keys[i]);
+    lbuf_putc(b, ' ');
+    lval_write(b, m->vals[i]);
+  }
+
+  lbuf_putc(b, '}');
+}
+
+// Views nested inside the one being written
+static _Thread_local int lval_view_depth = 0;
+
+// Written straight from the mapping, an element at a time. A corrupt file can
+// have a list contain itself, so nesting is bounded like `lview_materialize`
+static void lval_write_view(lbuf* b, lval* v) {
+  if (lval_view_depth == LVIEW_MAX_DEPTH) {
+    lbuf_puts(b, "Error: Corrupt view");
+    return;
+  }
+
+  lval_view_depth++;
+  lbuf_putc(b, '{');
+
+  for (int i = 0; i < v->count; i++) {
+    if (i) lbuf_putc(b, ' ');
+
+    lval* x = lview_cell(v, i);
+    lval_write(b, x);
+    lval_del(x);
+  }
+
+  lbuf_putc(b, '}');
+  lval_view_depth--;
+}
+
+void lval_write(lbuf* b, lval* v) {
+  switch (v->type) {
+    case LVAL_ERR:
+      lbuf_puts(b, "Error: ");
+      lbuf_puts(b, v->err);
+      break;
+    case LVAL_NUM:
+      lbuf_num(b, v->num);
+      break;
+    case LVAL_SYM:
+      lbuf_puts(b, v->sym);
+      break;
+    case LVAL_STR:
+      lval_write_str(b, v->str);
+      break;
+    case LVAL_SEXPR:
+      lval_write_expr(b, v, '(', ')');
+      break;
+    case LVAL_QEXPR:
+      lval_write_expr(b, v, '{', '}');
+      break;
+    case LVAL_FUN:
+      if (v->fun) {
+        lbuf_puts(b, "<builtin>");
+      } else {
+        lbuf_puts(b, "(\\ ");
+        lval_write(b, v->formals);
+        lbuf_putc(b, ' ');
+        lval_write(b, v->body);
+        lbuf_putc(b, ')');
+      }
+      break;
+    case LVAL_CHAN:
+      lbuf_puts(b, "<channel>");
+      break;
+    case LVAL_FUT:
+      lbuf_puts(b, "<future>");
+      break;
+    case LVAL_MAP:
+      lval_write_map(b, v);
+      break;
+    case LVAL_VIEW:
+      lval_write_view(b, v);
+      break;
+  }
+}
+
+// Printed form of `v`, to be freed by the caller
+char* lval_to_string(lval* v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+
+  return lbuf_take(&b);
+}
+
+void lval_print(lval* v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+  lbuf_flush(&b, STDOUT_FILENO);
+  lbuf_free(&b);
+}
+
+void lval_println(lval* v) {
+  lbuf b;
+  lbuf_init(&b);
+  lval_write(&b, v);
+  lbuf_putc(&b, '\n');
+  lbuf_flush(&b, STDOUT_FILENO);
+  lbuf_free(&b);
+}
+
+void lval_debug(lval* v) {
+  lbuf b;
+  lbuf_init(&b);
+  lbuf_puts(&b, "[DEBUG]: ");
+  lval_write(&b, v);
+  lbuf_putc(&b, '\n');
+  lbuf_flush(&b, STDOUT_FILENO);
+  lbuf_free(&b);
+}
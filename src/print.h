@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "lval.h"
+
+// Bytes kept inside the buffer itself, enough for most REPL results
+#define LBUF_INLINE 512
+
+// Growable output buffer. Values are written out in full here and handed to
+// the kernel with a single `write`, instead of a locked stdio call per atom.
+// Starts in `inline_data`, so short results never touch the heap
+typedef struct lbuf {
+  char* data;
+  size_t len;
+  size_t cap;
+  char inline_data[LBUF_INLINE];
+} lbuf;
+
+void lbuf_init(lbuf* b);
+void lbuf_free(lbuf* b);
+void lbuf_reserve(lbuf* b, size_t n);
+void lbuf_puts(lbuf* b, const char* s);
+void lbuf_num(lbuf* b, long x);
+char* lbuf_take(lbuf* b);
+int lbuf_flush(lbuf* b, int fd);
+
+static inline void lbuf_putc(lbuf* b, char c) {
+  if (b->len == b->cap) lbuf_reserve(b, 1);
+  b->data[b->len++] = c;
+}
+
+void lval_write(lbuf* b, lval* v);
+char* lval_to_string(lval* v);
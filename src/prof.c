@@ -0,0 +1,268 @@
+// sigaction and setitimer are not part of strict C17
+#define _DEFAULT_SOURCE
+
+#include "prof.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Samples per second of CPU time. Not a round number, so it doesn't line up
+// with anything periodic in the program
+#define LPROF_HZ 997
+
+// Room for samples, each a header followed by that many frames. Samples that
+// don't fit are counted and dropped. The header is the depth plus one, stored
+// after the frames, so 0 marks a sample still being written
+#define LPROF_BUFFER (1 << 21)
+
+#define LPROF_MAX_BUILTINS 128
+#define LPROF_NAME_BUCKETS 1024
+
+int lprof_enabled = 0;
+
+static char* lprof_path = NULL;
+static _Thread_local lprof_stack* lprof_current = NULL;
+
+static _Atomic(uintptr_t)* lprof_buf = NULL;
+static atomic_size_t lprof_used = 0;
+static atomic_long lprof_dropped = 0;
+
+// Names given to builtins in `add_builtins`
+static struct {
+  lbuiltin f;
+  const char* name;
+} lprof_builtins[LPROF_MAX_BUILTINS];
+static int lprof_nbuiltins = 0;
+
+// User functions are named after the symbol they're called through. Those
+// names are copied once and kept until exit, since samples point to them
+typedef struct lprof_name_entry {
+  struct lprof_name_entry* next;
+  char name[];
+} lprof_name_entry;
+
+static lprof_name_entry* lprof_names[LPROF_NAME_BUCKETS];
+static pthread_mutex_t lprof_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lprof_name_builtin(lbuiltin f, const char* name) {
+  if (lprof_nbuiltins == LPROF_MAX_BUILTINS) return;
+
+  lprof_builtins[lprof_nbuiltins].f = f;
+  lprof_builtins[lprof_nbuiltins].name = name;
+  lprof_nbuiltins++;
+}
+
+static const char* lprof_intern(char* sym) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (char* c = sym; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+
+  lprof_name_entry** bucket = &lprof_names[h % LPROF_NAME_BUCKETS];
+
+  pthread_mutex_lock(&lprof_names_lock);
+
+  lprof_name_entry* n = *bucket;
+  while (n && strcmp(n->name, sym) != 0) n = n->next;
+
+  if (n == NULL) {
+    n = malloc(sizeof(lprof_name_entry) + strlen(sym) + 1);
+    strcpy(n->name, sym);
+    n->next = *bucket;
+    *bucket = n;
+  }
+
+  pthread_mutex_unlock(&lprof_names_lock);
+
+  return n->name;
+}
+
+// Name of a frame calling `f`, through symbol `sym` if there was one
+const char* lprof_name(lval* f, char* sym) {
+  if (f->fun) {
+    for (int i = 0; i < lprof_nbuiltins; i++) {
+      if (lprof_builtins[i].f == f->fun) return lprof_builtins[i].name;
+    }
+
+    return "<builtin>";
+  }
+
+  return sym ? lprof_intern(sym) : "<lambda>";
+}
+
+lprof_stack* lprof_stack_new(void) { return calloc(1, sizeof(lprof_stack)); }
+
+void lprof_stack_del(lprof_stack* s) { free(s); }
+
+// Make `s` the stack this thread pushes to, returning the previous one.
+// Fibers swap theirs in while they run
+lprof_stack* lprof_switch(lprof_stack* s) {
+  lprof_stack* prev = lprof_current;
+  lprof_current = s;
+
+  return prev;
+}
+
+void lprof_push(const char* name) {
+  // Worker threads get a stack the first time they call something
+  lprof_stack* s = lprof_current;
+  if (s == NULL) s = lprof_current = lprof_stack_new();
+
+  int depth = s->depth;
+  if (depth < LPROF_MAX_DEPTH) s->frames[depth] = name;
+
+  // The handler must never see a frame counted before it's written
+  atomic_signal_fence(memory_order_seq_cst);
+  s->depth = depth + 1;
+}
+
+void lprof_pop(void) { lprof_current->depth--; }
+
+// Copy the interrupted thread's stack into the buffer. Only touches memory
+// reserved up front, so it's safe whatever the thread was doing
+static void lprof_handler(int sig) {
+  lprof_stack* s = lprof_current;
+
+  int depth = s ? s->depth : 0;
+  if (depth > LPROF_MAX_DEPTH) depth = LPROF_MAX_DEPTH;
+
+  // Only reserve room that fits, so everything below `lprof_used` is written
+  size_t at = atomic_load(&lprof_used);
+  do {
+    if (at + depth + 1 > LPROF_BUFFER) {
+      atomic_fetch_add(&lprof_dropped, 1);
+      return;
+    }
+  } while (!atomic_compare_exchange_weak(&lprof_used, &at, at + depth + 1));
+
+  for (int i = 0; i < depth; i++) {
+    atomic_store_explicit(&lprof_buf[at + 1 + i], (uintptr_t)s->frames[i],
+                          memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&lprof_buf[at], depth + 1, memory_order_release);
+}
+
+// Start sampling, to be written to `path` by `lprof_stop`
+int lprof_start(char* path) {
+  lprof_buf = calloc(LPROF_BUFFER, sizeof(uintptr_t));
+  if (lprof_buf == NULL) return 0;
+
+  lprof_path = path;
+  lprof_current = lprof_stack_new();
+  lprof_enabled = 1;
+
+  struct sigaction sa = {0};
+  sa.sa_handler = lprof_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  struct itimerval timer = {0};
+  timer.it_interval.tv_usec = 1000000 / LPROF_HZ;
+  timer.it_value = timer.it_interval;
+
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static int lprof_strcmp(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static const char* lprof_frame(size_t at) {
+  return (const char*)atomic_load_explicit(&lprof_buf[at],
+                                           memory_order_relaxed);
+}
+
+// Stop sampling and write one line per distinct stack, `outer;inner count`,
+// the collapsed format flame graph tools read
+void lprof_stop(void) {
+  if (!lprof_enabled) return;
+
+  struct itimerval timer = {0};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  size_t used = atomic_load(&lprof_used);
+
+  // Spell out every sample, then sort so equal stacks are next to each other
+  int count = 0;
+  int cap = 64;
+  char** lines = malloc(sizeof(char*) * cap);
+
+  for (size_t at = 0; at < used;) {
+    // A handler on another thread may have reserved room it hasn't filled
+    // yet. Its length isn't known until it has, so that's where samples end
+    uintptr_t header =
+        atomic_load_explicit(&lprof_buf[at], memory_order_acquire);
+    if (header == 0) break;
+
+    int depth = header - 1;
+
+    size_t len = 1;
+    for (int i = 0; i < depth; i++) {
+      len += strlen(lprof_frame(at + 1 + i)) + 1;
+    }
+
+    char* line = malloc(len + sizeof("[toplevel]"));
+    line[0] = '\0';
+    if (depth == 0) strcpy(line, "[toplevel]");
+
+    char* end = line;
+    for (int i = 0; i < depth; i++) {
+      if (i) *end++ = ';';
+      end = stpcpy(end, lprof_frame(at + 1 + i));
+    }
+
+    if (count == cap) {
+      cap *= 2;
+      lines = realloc(lines, sizeof(char*) * cap);
+    }
+    lines[count++] = line;
+
+    at += depth + 1;
+  }
+
+  qsort(lines, count, sizeof(char*), lprof_strcmp);
+
+  FILE* out = fopen(lprof_path, "w");
+  if (out == NULL) {
+    perror(lprof_path);
+  }
+
+  for (int i = 0; i < count;) {
+    int j = i;
+    while (j < count && strcmp(lines[i], lines[j]) == 0) j++;
+
+    if (out) fprintf(out, "%s %i\n", lines[i], j - i);
+    i = j;
+  }
+
+  if (out) {
+    fclose(out);
+    fprintf(stderr, "Wrote %i samples to %s", count, lprof_path);
+    if (lprof_dropped) fprintf(stderr, ", %li dropped", lprof_dropped);
+    fputc('\n', stderr);
+  }
+
+  for (int i = 0; i < count; i++) free(lines[i]);
+  free(lines);
+  free((void*)lprof_buf);
+
+  for (int i = 0; i < LPROF_NAME_BUCKETS; i++) {
+    while (lprof_names[i]) {
+      lprof_name_entry* n = lprof_names[i];
+      lprof_names[i] = n->next;
+      free(n);
+    }
+  }
+
+  lprof_stack_del(lprof_current);
+  lprof_current = NULL;
+  lprof_enabled = 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "lval.h"
+
+// Calls deeper than this are still made, but samples only show their callers
+#define LPROF_MAX_DEPTH 256
+
+// Names of the functions being called, outermost first. Each thread and each
+// fiber has its own, which the SIGPROF handler copies into the sample buffer
+typedef struct lprof_stack {
+  volatile int depth;
+  const char* frames[LPROF_MAX_DEPTH];
+} lprof_stack;
+
+// Checked before every call, so profiling costs nothing when it's off
+extern int lprof_enabled;
+
+void lprof_name_builtin(lbuiltin f, const char* name);
+const char* lprof_name(lval* f, char* sym);
+
+lprof_stack* lprof_stack_new(void);
+void lprof_stack_del(lprof_stack* s);
+lprof_stack* lprof_switch(lprof_stack* s);
+
+void lprof_push(const char* name);
+void lprof_pop(void);
+
+int lprof_start(char* path);
+void lprof_stop(void);
@@ -0,0 +1,675 @@
+#include "read.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fast.h"
+#include "grammar.h"
+#include "print.h"
+#include "scan.h"
+#include "stats.h"
+
+int lread_predict_enabled = 1;
+
+// Length of the token `d` matches at the start of `s`, 0 if none, with its
+// `accept` and how many bytes were looked at to find it in `seen`. One table
+// lookup per byte, with nothing to undo when a path fails
+static size_t ldfa_match(const ldfa* d, const char* s, size_t len,
+                         int* accept, size_t* seen) {
+  const int stride = lgrammar_class_count;
+  size_t result = 0;
+  int state = 1;
+  size_t i = 0;
+
+  while (i < len) {
+    state = d->next[state * stride + lgrammar_bytes[(unsigned char)s[i++]]];
+    if (state == 0) break;
+
+    if (d->run[state] != LRUN_NONE) {
+      i += lscan_run(&lgrammar_sets[d->run[state]], s + i, len - i);
+    }
+
+    if (d->accept[state]) {
+      result = i;
+      *accept = d->accept[state];
+    }
+  }
+
+  *seen = i;
+
+  return result;
+}
+
+typedef struct lreader {
+  const char* name;
+  const char* src;
+  size_t len;
+  size_t pos;
+
+  // Where `src` starts in the file, for errors
+  int row;
+  int col;
+
+  // Token automata run, and bytes they looked at past the token read
+  long tries;
+  long lookahead;
+
+  // Lists still open, innermost last
+  lval** open;
+  int depth;
+  int cap;
+
+  // Tokens copied out with a terminating NUL
+  lbuf tok;
+} lreader;
+
+static void lread_space(lreader* r) {
+  r->pos += lscan_run(&lgrammar_sets[LGRAMMAR_SPACE], r->src + r->pos,
+                      r->len - r->pos);
+}
+
+static char* lread_copy(lreader* r, const char* s, size_t n) {
+  r->tok.len = 0;
+  lbuf_reserve(&r->tok, n + 1);
+  memcpy(r->tok.data, s, n);
+  r->tok.data[n] = '\0';
+
+  return r->tok.data;
+}
+
+// Letters that can follow a backslash in a string, and the bytes they stand
+// for. `\0` stands for nothing, as it did when mpc unescaped strings
+static const char lread_escaped[] = "abfnrtv\\'\"0";
+static const char lread_escapes[] = "\a\b\f\n\r\t\v\\'\"";
+
+// Replace escapes in `s` with the bytes they stand for, in place. Unknown
+// ones are kept as they are
+static void lread_unescape(char* s) {
+  char* out = s;
+
+  for (; *s; s++) {
+    char* esc = s[0] == '\\' && s[1] ? strchr(lread_escaped, s[1]) : NULL;
+    if (esc == NULL) {
+      *out++ = *s;
+      continue;
+    }
+
+    char c = lread_escapes[esc - lread_escaped];
+    if (c) *out++ = c;
+    s++;
+  }
+
+  *out = '\0';
+}
+
+static lval* lread_token(lreader* r, int rule, const char* s, size_t n) {
+  switch (rule) {
+    case LRULE_NUMBER: {
+      char* digits = lread_copy(r, s, n);
+
+      // `strtol` uses a global variable, `errno`, for some reason
+      errno = 0;
+      long x = strtol(digits, NULL, 10);
+
+      return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+    }
+
+    case LRULE_STRING: {
+      // Drop the quotes on either side before unescaping
+      char* unescaped = malloc(n - 1);
+      memcpy(unescaped, s + 1, n - 2);
+      unescaped[n - 2] = '\0';
+
+      lread_unescape(unescaped);
+      lval* str = lval_str(unescaped);
+      free(unescaped);
+
+      return str;
+    }
+
+    default:
+      return lval_sym(lread_copy(r, s, n));
+  }
+}
+
+// Move a row and column past `n` bytes of text
+static void lread_advance(int* row, int* col, const char* s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == '\n') {
+      (*row)++;
+      *col = 1;
+    } else {
+      (*col)++;
+    }
+  }
+}
+
+// Where reading stopped, in the form mpc gives its errors
+static lval* lread_error(lreader* r) {
+  int row = r->row;
+  int col = r->col;
+  lread_advance(&row, &col, r->src, r->pos);
+
+  lbuf b;
+  lbuf_init(&b);
+
+  for (int i = 0; i < LRULE_COUNT; i++) {
+    if (i) lbuf_puts(&b, ", ");
+    lbuf_puts(&b, lgrammar_names[lgrammar_order[i]]);
+  }
+
+  lbuf_puts(&b, " or ");
+
+  if (r->depth) {
+    int rule = r->open[r->depth - 1]->type == LVAL_SEXPR ? LRULE_SEXPR
+                                                         : LRULE_QEXPR;
+    char close[] = {'\'', lgrammar_close[rule], '\'', '\0'};
+    lbuf_puts(&b, close);
+  } else {
+    lbuf_puts(&b, "end of input");
+  }
+
+  lbuf_puts(&b, " at ");
+
+  if (r->pos == r->len) {
+    lbuf_puts(&b, "end of input");
+  } else {
+    char at[] = {'\'', r->src[r->pos], '\'', '\0'};
+    lbuf_puts(&b, at);
+  }
+
+  char* expected = lbuf_take(&b);
+  lval* err = lval_err("%s:%i:%i: expected %s", r->name, row, col, expected);
+  free(expected);
+
+  return err;
+}
+
+// Kinds of token besides the rules: a closing bracket, the end of the input
+// and a byte no token starts with
+enum { LTOK_CLOSE = LRULE_COUNT, LTOK_END, LTOK_BAD };
+
+static size_t lread_match(lreader* r, const ldfa* d, int* accept) {
+  size_t seen;
+  size_t n = ldfa_match(d, r->src + r->pos, r->len - r->pos, accept, &seen);
+
+  r->tries++;
+  r->lookahead += seen - n;
+
+  return n;
+}
+
+// Kind of the token at the reader's position, and its length in `n`. Brackets
+// are tokens of their own, opening ones by the rule they open
+static int lread_next(lreader* r, size_t* n) {
+  if (r->pos == r->len) return LTOK_END;
+
+  int starts = lgrammar_first[(unsigned char)r->src[r->pos]];
+  int accept;
+
+  *n = 1;
+  if (starts & LFIRST_CLOSE) return LTOK_CLOSE;
+
+  // A list from its first byte, or the token all of them at once choose
+  if (lread_predict_enabled) {
+    if (starts & LFIRST_LISTS) {
+      return starts >> LRULE_SEXPR & 1 ? LRULE_SEXPR : LRULE_QEXPR;
+    }
+
+    if (starts == 0) return LTOK_BAD;
+
+    *n = lread_match(r, &lgrammar_choice, &accept);
+    return *n ? accept - 1 : LTOK_BAD;
+  }
+
+  // The first alternative of `expr` that can start here and matches
+  for (int i = 0; i < LRULE_COUNT; i++) {
+    int rule = lgrammar_order[i];
+    if (!(starts >> rule & 1)) continue;
+
+    if (lgrammar_open[rule]) return rule;
+
+    *n = lread_match(r, &lgrammar_tokens[rule], &accept);
+    if (*n) return rule;
+  }
+
+  return LTOK_BAD;
+}
+
+static int lread_rule(lval* list) {
+  return list->type == LVAL_SEXPR ? LRULE_SEXPR : LRULE_QEXPR;
+}
+
+// Text starting at `row` and `col` of the file into values
+static lval* lread_at(const char* name, const char* src, size_t len, int row,
+                      int col) {
+  lreader r = {.name = name, .src = src, .len = len, .row = row, .col = col};
+  lbuf_init(&r.tok);
+
+  // Lists from source can be quickened wherever they end up evaluated
+  lval* root = lval_sexpr();
+  root->site = lsite_new();
+
+  lread_space(&r);
+
+  for (;;) {
+    lval* top = r.depth ? r.open[r.depth - 1] : root;
+
+    size_t n;
+    int tok = lread_next(&r, &n);
+
+    if (tok == LTOK_END && r.depth == 0) break;
+
+    if (tok == LTOK_END || tok == LTOK_BAD ||
+        (tok == LTOK_CLOSE &&
+         (r.depth == 0 || src[r.pos] != lgrammar_close[lread_rule(top)]))) {
+      lval* err = lread_error(&r);
+      lval_del(root);
+      root = err;
+      break;
+    }
+
+    if (tok == LTOK_CLOSE) {
+      r.depth--;
+    } else if (lgrammar_open[tok]) {
+      lval* x = tok == LRULE_SEXPR ? lval_sexpr() : lval_qexpr();
+      x->site = lsite_new();
+      lval_add(top, x);
+
+      if (r.depth == r.cap) {
+        r.cap = r.cap ? r.cap * 2 : 16;
+        r.open = realloc(r.open, sizeof(lval*) * r.cap);
+      }
+
+      r.open[r.depth++] = x;
+    } else {
+      lval_add(top, lread_token(&r, tok, src + r.pos, n));
+    }
+
+    r.pos += n;
+    lread_space(&r);
+  }
+
+  free(r.open);
+  lbuf_free(&r.tok);
+  lstats_read(r.tries, r.lookahead);
+
+  return root;
+}
+
+// Where top-level expressions end, found without reading them. An
+// expression ends at a closing bracket or at whitespace, as long as no list
+// or string is open. Strings are followed with their automaton, since they
+// are the only tokens that can have brackets and whitespace in them
+typedef struct lbounds {
+  // How far the text has been looked at, and the end of the last complete
+  // expression before that, 0 if none
+  size_t pos;
+  size_t end;
+
+  // Lists open at `pos`, and the state of the string automaton there, 0
+  // outside a string, with `accept` where the string would end so far
+  int depth;
+  int string;
+  size_t accept;
+} lbounds;
+
+// Look for boundaries in the text from where the last look stopped
+static void lbounds_scan(lbounds* b, const char* src, size_t len) {
+  const ldfa* string = &lgrammar_tokens[LRULE_STRING];
+  size_t i = b->pos;
+
+  while (i < len) {
+    if (b->string) {
+      int state = string->next[b->string * lgrammar_class_count +
+                               lgrammar_bytes[(unsigned char)src[i++]]];
+
+      if (state && string->run[state] != LRUN_NONE) {
+        i += lscan_run(&lgrammar_sets[string->run[state]], src + i, len - i);
+      }
+
+      if (state && string->accept[state]) b->accept = i;
+
+      // Anything after where the string ended is looked at again
+      if (state == 0 && b->accept) i = b->accept;
+      b->string = state;
+      continue;
+    }
+
+    int starts = lgrammar_first[(unsigned char)src[i]];
+
+    if (starts & LFIRST_CLOSE) {
+      if (b->depth) b->depth--;
+      if (!b->depth) b->end = i + 1;
+      i++;
+    } else if (starts & LFIRST_LISTS) {
+      if (!b->depth) b->end = i;
+      b->depth++;
+      i++;
+    } else if (starts >> LRULE_STRING & 1) {
+      b->string = 1;
+      b->accept = 0;
+    } else if (lgrammar_sets[LGRAMMAR_SPACE].bytes[(unsigned char)src[i]]) {
+      if (!b->depth) b->end = i;
+      i += lscan_run(&lgrammar_sets[LGRAMMAR_SPACE], src + i, len - i);
+    } else {
+      i++;
+    }
+  }
+
+  b->pos = i;
+}
+
+// Forget the first `n` bytes of the text, up to a boundary
+static void lbounds_drop(lbounds* b, size_t n) {
+  b->pos -= n;
+  b->end -= n;
+  if (b->string) b->accept -= n;
+}
+
+int lread_threads = 1;
+
+// Text is only split when every thread gets at least this much of it
+#define LREAD_PAR_MIN (256 * 1024)
+
+typedef struct lread_piece {
+  size_t start;
+  size_t len;
+  lval* forms;
+} lread_piece;
+
+typedef struct lread_job {
+  const char* name;
+  const char* src;
+  lread_piece* pieces;
+  int count;
+  atomic_int next;
+} lread_job;
+
+// Workers (including the calling thread) claim pieces one at a time until
+// there are none left
+static void* lread_worker(void* arg) {
+  lread_job* job = arg;
+
+  int i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    lread_piece* p = &job->pieces[i];
+    p->forms = lread_at(job->name, job->src + p->start, p->len, 1, 1);
+  }
+
+  return NULL;
+}
+
+// The text split at top-level expressions into a few pieces per thread, read
+// at once and joined back in order
+static lval* lread_par(const char* name, const char* src, size_t len,
+                       int threads) {
+  size_t size = len / (threads * 4) + 1;
+  int cap = threads * 4 + 1;
+  lread_piece* pieces = malloc(sizeof(lread_piece) * cap);
+  int count = 0;
+
+  lbounds b = {0};
+  size_t start = 0;
+
+  for (size_t limit = size; start < len; limit += size) {
+    if (limit > len) limit = len;
+
+    lbounds_scan(&b, src, limit);
+
+    // Whatever is left at the end is one piece, complete or not
+    if (limit == len) b.end = len;
+    if (b.end <= start) continue;
+
+    if (count == cap) {
+      cap *= 2;
+      pieces = realloc(pieces, sizeof(lread_piece) * cap);
+    }
+
+    pieces[count++] = (lread_piece){.start = start, .len = b.end - start};
+    start = b.end;
+  }
+
+  lread_job job = {.name = name, .src = src, .pieces = pieces, .count = count};
+  atomic_init(&job.next, 0);
+
+  pthread_t workers[threads - 1];
+  int started = 0;
+
+  for (int i = 0; i < threads - 1 && i < count - 1; i++) {
+    if (pthread_create(&workers[i], NULL, lread_worker, &job) != 0) break;
+    started++;
+  }
+
+  lread_worker(&job);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  lval* root = NULL;
+
+  for (int i = 0; i < count; i++) {
+    lval* x = pieces[i].forms;
+
+    if (root && root->type == LVAL_ERR) {
+      lval_del(x);
+      continue;
+    }
+
+    // The first piece that failed has the error reading the whole text at
+    // once would give. It's read again knowing where it starts, for that
+    if (x->type == LVAL_ERR) {
+      int row = 1;
+      int col = 1;
+      lread_advance(&row, &col, src, pieces[i].start);
+
+      lval_del(x);
+      if (root) lval_del(root);
+      root = lread_at(name, src + pieces[i].start, pieces[i].len, row, col);
+      continue;
+    }
+
+    root = root ? lval_join(root, x) : x;
+  }
+
+  free(pieces);
+
+  return root;
+}
+
+lval* lread(const char* name, const char* src, size_t len) {
+  if (lread_threads > 1 && len >= LREAD_PAR_MIN * (size_t)lread_threads) {
+    return lread_par(name, src, len, lread_threads);
+  }
+
+  return lread_at(name, src, len, 1, 1);
+}
+
+// Number of tokens in the text, without building anything from them
+lval* lread_tokens(const char* name, const char* src, size_t len) {
+  lreader r = {.name = name, .src = src, .len = len, .row = 1, .col = 1};
+  long count = 0;
+
+  lread_space(&r);
+
+  for (;;) {
+    size_t n;
+    int tok = lread_next(&r, &n);
+
+    if (tok == LTOK_END) break;
+    if (tok == LTOK_BAD) break;
+
+    count++;
+    r.pos += n;
+    lread_space(&r);
+  }
+
+  lstats_read(r.tries, r.lookahead);
+
+  return r.pos == r.len ? lval_num(count) : lread_error(&r);
+}
+
+// The whole of the file at `path`, or an error
+static lval* lread_slurp(const char* path, lbuf* b) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return lval_err("Could not open '%s': %s", path, strerror(errno));
+  }
+
+  for (;;) {
+    lbuf_reserve(b, 64 * 1024);
+
+    size_t n = fread(b->data + b->len, 1, b->cap - b->len, f);
+    b->len += n;
+
+    if (n == 0) break;
+  }
+
+  int failed = ferror(f);
+  fclose(f);
+
+  return failed ? lval_err("Could not read '%s'", path) : NULL;
+}
+
+lval* lread_file(const char* path) {
+  lbuf b;
+  lbuf_init(&b);
+
+  lval* x = lread_slurp(path, &b);
+  if (x == NULL) x = lread(path, b.data, b.len);
+
+  lbuf_free(&b);
+
+  return x;
+}
+
+lval* lread_file_tokens(const char* path) {
+  lbuf b;
+  lbuf_init(&b);
+
+  lval* x = lread_slurp(path, &b);
+  if (x == NULL) x = lread_tokens(path, b.data, b.len);
+
+  lbuf_free(&b);
+
+  return x;
+}
+
+struct lstream {
+  const char* name;
+  int fd;
+  int eof;
+  int done;
+
+  // Text read but not yet handed to the reader
+  lbuf buf;
+
+  // Where the expressions in `buf` end
+  lbounds bounds;
+
+  // Where `buf` starts in the stream, for errors
+  int row;
+  int col;
+
+  // Expressions read but not yet handed out, from the `next`th on
+  lval* forms;
+  int next;
+};
+
+lstream* lstream_new(const char* name, int fd) {
+  lstream* s = calloc(1, sizeof(lstream));
+  s->name = name;
+  s->fd = fd;
+  s->row = 1;
+  s->col = 1;
+  lbuf_init(&s->buf);
+
+  return s;
+}
+
+void lstream_del(lstream* s) {
+  if (s->forms) {
+    for (int i = s->next; i < s->forms->count; i++) lval_del(s->forms->cell[i]);
+    s->forms->count = 0;
+    lval_del(s->forms);
+  }
+
+  lbuf_free(&s->buf);
+  free(s);
+}
+
+// Read more of the stream, at the end of the buffer
+static lval* lstream_fill(lstream* s) {
+  lbuf_reserve(&s->buf, 64 * 1024);
+
+  for (;;) {
+    ssize_t n = read(s->fd, s->buf.data + s->buf.len, s->buf.cap - s->buf.len);
+
+    if (n > 0) s->buf.len += n;
+    if (n == 0) s->eof = 1;
+    if (n >= 0) return NULL;
+
+    if (errno != EINTR) {
+      return lval_err("Could not read '%s': %s", s->name, strerror(errno));
+    }
+  }
+}
+
+lval* lstream_next(lstream* s) {
+  for (;;) {
+    if (s->forms && s->next < s->forms->count) {
+      return s->forms->cell[s->next++];
+    }
+
+    if (s->forms) {
+      // Every expression was handed out
+      s->forms->count = 0;
+      lval_del(s->forms);
+      s->forms = NULL;
+    }
+
+    if (s->done) return NULL;
+
+    lbounds_scan(&s->bounds, s->buf.data, s->buf.len);
+    size_t end = s->bounds.end;
+
+    if (end == 0 && !s->eof) {
+      lval* err = lstream_fill(s);
+      if (err) {
+        s->done = 1;
+        return err;
+      }
+
+      continue;
+    }
+
+    // At the end of the stream whatever is left has to be complete
+    if (s->eof) {
+      end = s->buf.len;
+      s->done = 1;
+    }
+
+    lval* x = lread_at(s->name, s->buf.data, end, s->row, s->col);
+
+    lread_advance(&s->row, &s->col, s->buf.data, end);
+
+    s->buf.len -= end;
+    memmove(s->buf.data, s->buf.data + end, s->buf.len);
+    lbounds_drop(&s->bounds, end);
+
+    // Nothing after a syntax error can be trusted to line up
+    if (x->type == LVAL_ERR) {
+      s->done = 1;
+      return x;
+    }
+
+    s->forms = x;
+    s->next = 0;
+  }
+}
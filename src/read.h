@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "lval.h"
+
+// Source text into values, by the tables generated from lispy.grammar. The
+// result is an S-Expression of every top-level expression in the text, or an
+// error saying where the text stops following the grammar
+lval* lread(const char* name, const char* src, size_t len);
+
+// Set to 0 to try the tokens a byte can start one after another, as `expr`
+// orders them, instead of all at once
+extern int lread_predict_enabled;
+
+// Threads reading a large text at once, 1 to read it all on the calling one.
+// The text is split where top-level expressions end, so each piece can be
+// read on its own. No more than LREAD_MAX_THREADS
+extern int lread_threads;
+
+#define LREAD_MAX_THREADS 256
+
+lval* lread_file(const char* path);
+
+// Only splitting the text into tokens, giving how many there are. Times the
+// tokenizer on its own
+lval* lread_tokens(const char* name, const char* src, size_t len);
+lval* lread_file_tokens(const char* path);
+
+// Reading one top-level expression at a time from a file descriptor, so
+// input of any length is evaluated as it arrives, holding no more of it than
+// the expression being read. Gives NULL at the end of the input, and nothing
+// more after an error
+typedef struct lstream lstream;
+
+lstream* lstream_new(const char* name, int fd);
+lval* lstream_next(lstream* s);
+void lstream_del(lstream* s);
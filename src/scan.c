@@ -0,0 +1,116 @@
+#include "scan.h"
+
+#include <stdatomic.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+int lscan_simd_enabled = 1;
+
+typedef size_t (*lscan_fn)(const lbyteset*, const char*, size_t);
+
+static size_t lscan_scalar(const lbyteset* set, const char* s, size_t len) {
+  size_t i = 0;
+  while (i < len && set->bytes[(unsigned char)s[i]]) i++;
+
+  return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+// Membership of every byte of a vector at once: the low nibble picks a row
+// from each table, the high nibble which of the two rows and which bit of it.
+// Any set of bytes works, where PCMPISTRI ranges would only take eight ranges
+
+__attribute__((target("sse4.2"))) static size_t lscan_sse(
+    const lbyteset* set, const char* s, size_t len) {
+  const __m128i lo = _mm_loadu_si128((const __m128i*)set->lo);
+  const __m128i hi = _mm_loadu_si128((const __m128i*)set->hi);
+  const __m128i bits =
+      _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i seven = _mm_set1_epi8(7);
+
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i l = _mm_and_si128(x, nibble);
+    __m128i h = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+
+    __m128i row = _mm_blendv_epi8(_mm_shuffle_epi8(lo, l),
+                                  _mm_shuffle_epi8(hi, l),
+                                  _mm_cmpgt_epi8(h, seven));
+    __m128i bit = _mm_shuffle_epi8(bits, h);
+    __m128i in = _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+
+    unsigned mask = ~_mm_movemask_epi8(in) & 0xffff;
+    if (mask) return i + __builtin_ctz(mask);
+  }
+
+  return i + lscan_scalar(set, s + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t lscan_avx2(const lbyteset* set,
+                                                         const char* s,
+                                                         size_t len) {
+  const __m256i lo =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set->lo));
+  const __m256i hi =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set->hi));
+  const __m256i bits = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+      16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i seven = _mm256_set1_epi8(7);
+
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+    __m256i l = _mm256_and_si256(x, nibble);
+    __m256i h = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo, l),
+                                     _mm256_shuffle_epi8(hi, l),
+                                     _mm256_cmpgt_epi8(h, seven));
+    __m256i bit = _mm256_shuffle_epi8(bits, h);
+    __m256i in = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(in);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+
+  return i + lscan_sse(set, s + i, len - i);
+}
+
+static lscan_fn lscan_best(void) {
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) return lscan_avx2;
+  if (__builtin_cpu_supports("sse4.2")) return lscan_sse;
+
+  return lscan_scalar;
+}
+
+#else
+
+static lscan_fn lscan_best(void) { return lscan_scalar; }
+
+#endif
+
+static _Atomic(lscan_fn) lscan_vector = NULL;
+
+// The rest of a run found long enough to be worth vectors
+size_t lscan_wide(const lbyteset* set, const char* s, size_t len) {
+  if (!lscan_simd_enabled) return lscan_scalar(set, s, len);
+
+  lscan_fn f = atomic_load_explicit(&lscan_vector, memory_order_relaxed);
+  if (f == NULL) {
+    f = lscan_best();
+    atomic_store_explicit(&lscan_vector, f, memory_order_relaxed);
+  }
+
+  return f(set, s, len);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Set to 0 to classify bytes one at a time even where the CPU has vectors
+extern int lscan_simd_enabled;
+
+// A set of bytes, kept both as a flag per byte for the scalar loop and as
+// nibble tables for the vector ones. Bit `h` of `lo[l]` says whether the byte
+// with high nibble `h` and low nibble `l` is in the set, for `h` below 8, and
+// `hi[l]` the same for the rest
+typedef struct lbyteset {
+  uint8_t lo[16];
+  uint8_t hi[16];
+  uint8_t bytes[256];
+} lbyteset;
+
+// Bytes looked at one by one before going wide. Most runs are shorter, and
+// vectors only pay off from a couple of dozen bytes on
+#define LSCAN_NARROW 16
+
+size_t lscan_wide(const lbyteset* set, const char* s, size_t len);
+
+// Length of the run of bytes from `set` at the start of `s`
+static inline size_t lscan_run(const lbyteset* set, const char* s,
+                               size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (!set->bytes[(unsigned char)s[i]]) return i;
+    if (i + 1 == LSCAN_NARROW) {
+      return LSCAN_NARROW + lscan_wide(set, s + i + 1, len - i - 1);
+    }
+  }
+
+  return len;
+}
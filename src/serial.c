@@ -0,0 +1,671 @@
+#include "serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "map.h"
+#include "print.h"
+#include "view.h"
+
+#define LSER_MAGIC "LSPB"
+#define LSER_VERSION 1
+
+// Output is handed to the kernel, and input read from it, this much at a time
+#define LSER_CHUNK (1 << 16)
+
+// Limits on what a reader accepts, so a corrupt file is an error rather than
+// a crash
+#define LSER_MAX_DEPTH 10000
+#define LSER_MAX_STRING (1 << 30)
+
+enum {
+  LSER_NUM,
+  LSER_SYM,
+  LSER_SYMREF,
+  LSER_STR,
+  LSER_ERR,
+  LSER_SEXPR,
+  LSER_QEXPR,
+  LSER_LAMBDA,
+  LSER_MAP,
+  LSER_BUILTIN,
+};
+
+struct lser_writer {
+  int fd;
+  int failed;
+  lbuf out;
+
+  // Symbols written so far, by open addressing on their hash. Each slot holds
+  // a copy of the name and its number
+  int nsyms;
+  int cap;  // Always a power of two
+  char** names;
+  int* ids;
+};
+
+struct lser_reader {
+  int fd;  // -1 when reading from memory
+  int started;
+  const char* error;
+  int depth;
+
+  unsigned char* buf;
+  size_t pos;
+  size_t len;
+
+  // Names of the symbols seen so far, by number
+  int nsyms;
+  int cap;
+  char** names;
+};
+
+static uint32_t lser_hash(char* s) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+
+  return h;
+}
+
+lser_writer* lser_writer_new(int fd) {
+  lser_writer* w = calloc(1, sizeof(lser_writer));
+
+  w->fd = fd;
+  lbuf_init(&w->out);
+  lbuf_puts(&w->out, LSER_MAGIC);
+  lbuf_putc(&w->out, LSER_VERSION);
+
+  w->cap = 64;
+  w->names = calloc(w->cap, sizeof(char*));
+  w->ids = malloc(sizeof(int) * w->cap);
+
+  return w;
+}
+
+static void lser_flush(lser_writer* w) {
+  if (!lbuf_flush(&w->out, w->fd)) w->failed = 1;
+}
+
+static void lser_put_uint(lser_writer* w, unsigned long x) {
+  lbuf_reserve(&w->out, 10);
+
+  char* p = w->out.data + w->out.len;
+  while (x >= 0x80) {
+    *p++ = (char)(x | 0x80);
+    x >>= 7;
+  }
+  *p++ = (char)x;
+
+  w->out.len = p - w->out.data;
+}
+
+static void lser_put_bytes(lser_writer* w, int tag, char* s) {
+  size_t n = strlen(s);
+
+  lbuf_putc(&w->out, tag);
+  lser_put_uint(w, n);
+  lbuf_reserve(&w->out, n);
+  memcpy(w->out.data + w->out.len, s, n);
+  w->out.len += n;
+}
+
+// Slot of `name` in the symbol table, or the empty slot it would go in
+static int lser_slot(lser_writer* w, char* name) {
+  int i = lser_hash(name) & (w->cap - 1);
+  while (w->names[i] && strcmp(w->names[i], name) != 0) {
+    i = (i + 1) & (w->cap - 1);
+  }
+
+  return i;
+}
+
+static void lser_grow(lser_writer* w) {
+  int cap = w->cap;
+  char** names = w->names;
+  int* ids = w->ids;
+
+  w->cap *= 2;
+  w->names = calloc(w->cap, sizeof(char*));
+  w->ids = malloc(sizeof(int) * w->cap);
+
+  for (int i = 0; i < cap; i++) {
+    if (names[i] == NULL) continue;
+
+    int j = lser_slot(w, names[i]);
+    w->names[j] = names[i];
+    w->ids[j] = ids[i];
+  }
+
+  free(names);
+  free(ids);
+}
+
+static void lser_put_sym(lser_writer* w, char* name) {
+  int i = lser_slot(w, name);
+
+  if (w->names[i]) {
+    lbuf_putc(&w->out, LSER_SYMREF);
+    lser_put_uint(w, w->ids[i]);
+    return;
+  }
+
+  w->names[i] = malloc(strlen(name) + 1);
+  strcpy(w->names[i], name);
+  w->ids[i] = w->nsyms++;
+
+  if (w->nsyms * 2 > w->cap) lser_grow(w);
+
+  lser_put_bytes(w, LSER_SYM, name);
+}
+
+// First value in `v` that has no encoding, if any
+static lval* lser_unsaveable(lval* v) {
+  switch (v->type) {
+    case LVAL_FUN:
+      if (v->fun) return builtin_name(v->fun) ? NULL : v;
+
+      for (int i = 0; i < v->env->count; i++) {
+        lval* x = lser_unsaveable(v->env->vals[i]);
+        if (x) return x;
+      }
+
+      return lser_unsaveable(v->body);
+
+    case LVAL_CHAN:
+    case LVAL_FUT:
+      return v;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lval* x = lser_unsaveable(v->cell[i]);
+        if (x) return x;
+      }
+
+      return NULL;
+
+    case LVAL_MAP:
+      for (int i = 0; i < v->map->cap; i++) {
+        if (v->map->ctrl[i] < 0) continue;
+
+        lval* x = lser_unsaveable(v->map->vals[i]);
+        if (x) return x;
+      }
+
+      return NULL;
+
+    default:
+      return NULL;
+  }
+}
+
+static void lser_put(lser_writer* w, lval* v) {
+  if (w->out.len >= LSER_CHUNK) lser_flush(w);
+
+  switch (v->type) {
+    case LVAL_NUM: {
+      // Zigzag, so small negative numbers stay short too
+      unsigned long n = (unsigned long)v->num;
+      lbuf_putc(&w->out, LSER_NUM);
+      lser_put_uint(w, (n << 1) ^ -(n >> (sizeof(long) * 8 - 1)));
+      break;
+    }
+
+    case LVAL_SYM:
+      lser_put_sym(w, v->sym);
+      break;
+
+    case LVAL_STR:
+      lser_put_bytes(w, LSER_STR, v->str);
+      break;
+
+    case LVAL_ERR:
+      lser_put_bytes(w, LSER_ERR, v->err);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lbuf_putc(&w->out, v->type == LVAL_SEXPR ? LSER_SEXPR : LSER_QEXPR);
+      lser_put_uint(w, v->count);
+
+      for (int i = 0; i < v->count; i++) lser_put(w, v->cell[i]);
+      break;
+
+    case LVAL_FUN:
+      // Builtins by name, since their addresses change from run to run
+      if (v->fun) {
+        lser_put_bytes(w, LSER_BUILTIN, builtin_name(v->fun));
+        break;
+      }
+
+      lbuf_putc(&w->out, LSER_LAMBDA);
+      lser_put_uint(w, v->env->count);
+
+      for (int i = 0; i < v->env->count; i++) {
+        lser_put_sym(w, v->env->syms[i]);
+        lser_put(w, v->env->vals[i]);
+      }
+
+      lser_put(w, v->formals);
+      lser_put(w, v->body);
+      break;
+
+    case LVAL_VIEW: {
+      // Written as the Q-Expression it holds
+      lval* x = lview_materialize(v);
+      lser_put(w, x);
+      lval_del(x);
+      break;
+    }
+
+    case LVAL_MAP: {
+      lmap* m = v->map;
+
+      lbuf_putc(&w->out, LSER_MAP);
+      lser_put_uint(w, m->count);
+
+      for (int i = 0; i < m->cap; i++) {
+        if (m->ctrl[i] < 0) continue;
+
+        lser_put(w, m->keys[i]);
+        lser_put(w, m->vals[i]);
+      }
+      break;
+    }
+  }
+}
+
+// Append `v` to the stream. NULL when it was written, an error otherwise
+lval* lser_write(lser_writer* w, lval* v) {
+  lval* x = lser_unsaveable(v);
+  if (x) return lval_err("Cannot save a %s", ltype_name(x->type));
+
+  lser_put(w, v);
+
+  return NULL;
+}
+
+// Write out whatever is still buffered and free the writer. 0 if anything
+// couldn't be written
+int lser_writer_del(lser_writer* w) {
+  lser_flush(w);
+  int ok = !w->failed;
+
+  for (int i = 0; i < w->cap; i++) free(w->names[i]);
+  free(w->names);
+  free(w->ids);
+  lbuf_free(&w->out);
+  free(w);
+
+  return ok;
+}
+
+lser_reader* lser_reader_new(int fd) {
+  lser_reader* r = calloc(1, sizeof(lser_reader));
+
+  r->fd = fd;
+  r->buf = malloc(LSER_CHUNK);
+
+  return r;
+}
+
+// Read the `size` bytes at `data` instead of a file. They're borrowed, and
+// must outlive the reader
+lser_reader* lser_reader_mem(const void* data, size_t size) {
+  lser_reader* r = calloc(1, sizeof(lser_reader));
+
+  r->fd = -1;
+  r->buf = (unsigned char*)data;
+  r->len = size;
+
+  return r;
+}
+
+// Next byte of the stream, or -1 at its end
+static int lser_byte(lser_reader* r) {
+  if (r->pos == r->len) {
+    if (r->fd < 0) return -1;
+
+    ssize_t n;
+    do {
+      n = read(r->fd, r->buf, LSER_CHUNK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) return -1;
+
+    r->pos = 0;
+    r->len = n;
+  }
+
+  return r->buf[r->pos++];
+}
+
+static lval* lser_fail(lser_reader* r, const char* error) {
+  if (r->error == NULL) r->error = error;
+  return NULL;
+}
+
+static int lser_get_uint(lser_reader* r, unsigned long* x) {
+  *x = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = lser_byte(r);
+    if (c < 0) return 0;
+
+    *x |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return 1;
+  }
+
+  return 0;
+}
+
+// A length prefixed string, NUL terminated and owned by the caller
+static char* lser_get_bytes(lser_reader* r) {
+  unsigned long n;
+  if (!lser_get_uint(r, &n) || n > LSER_MAX_STRING) return NULL;
+
+  char* s = malloc(n + 1);
+
+  // Straight from the buffer, refilling it as it runs out
+  for (size_t done = 0; done < n;) {
+    if (r->pos == r->len) {
+      int c = lser_byte(r);
+      if (c < 0) {
+        free(s);
+        return NULL;
+      }
+      s[done++] = c;
+      continue;
+    }
+
+    size_t k = r->len - r->pos;
+    if (k > n - done) k = n - done;
+
+    memcpy(s + done, r->buf + r->pos, k);
+    r->pos += k;
+    done += k;
+  }
+
+  s[n] = '\0';
+
+  return s;
+}
+
+static lval* lser_get(lser_reader* r, lenv* e);
+
+static lval* lser_get_sym(lser_reader* r, int tag) {
+  if (tag == LSER_SYMREF) {
+    unsigned long i;
+    if (!lser_get_uint(r, &i) || i >= (unsigned long)r->nsyms) {
+      return lser_fail(r, "bad symbol reference");
+    }
+
+    return lval_sym(r->names[i]);
+  }
+
+  char* name = lser_get_bytes(r);
+  if (name == NULL) return lser_fail(r, "truncated symbol");
+
+  if (r->nsyms == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 64;
+    r->names = realloc(r->names, sizeof(char*) * r->cap);
+  }
+  r->names[r->nsyms++] = name;
+
+  return lval_sym(name);
+}
+
+static lval* lser_get_list(lser_reader* r, lenv* e, lval* x) {
+  unsigned long n;
+  if (!lser_get_uint(r, &n)) {
+    lval_del(x);
+    return lser_fail(r, "truncated list");
+  }
+
+  for (unsigned long i = 0; i < n; i++) {
+    lval* c = lser_get(r, e);
+    if (c == NULL) {
+      lval_del(x);
+      return NULL;
+    }
+
+    lval_add(x, c);
+  }
+
+  return x;
+}
+
+// A lambda's captured locals are read into a scratch environment, which
+// `lval_lambda` captures from again just as when it was first made
+static lval* lser_get_lambda(lser_reader* r, lenv* e) {
+  unsigned long n;
+  if (!lser_get_uint(r, &n)) return lser_fail(r, "truncated function");
+
+  lenv* c = lenv_new();
+  c->par = lenv_root(e);
+
+  lval* formals = NULL;
+  lval* body = NULL;
+
+  for (unsigned long i = 0; i < n; i++) {
+    lval* k = lser_get(r, e);
+    lval* v = k ? lser_get(r, e) : NULL;
+
+    if (k && v && k->type == LVAL_SYM) lenv_put(c, k, v);
+
+    int ok = k && v && k->type == LVAL_SYM;
+    if (k) lval_del(k);
+    if (v) lval_del(v);
+
+    if (!ok) goto fail;
+  }
+
+  formals = lser_get(r, e);
+  if (formals == NULL || formals->type != LVAL_QEXPR) goto fail;
+
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->type != LVAL_SYM) goto fail;
+  }
+
+  body = lser_get(r, e);
+  if (body == NULL) goto fail;
+
+  lval* f = lval_lambda(c, formals, body);
+  lenv_del(c);
+
+  return f;
+
+fail:
+  if (formals) lval_del(formals);
+  lenv_del(c);
+
+  return lser_fail(r, "malformed function");
+}
+
+static lval* lser_get_map(lser_reader* r, lenv* e) {
+  unsigned long n;
+  if (!lser_get_uint(r, &n)) return lser_fail(r, "truncated map");
+
+  lval* x = lval_map(lmap_new());
+
+  for (unsigned long i = 0; i < n; i++) {
+    lval* k = lser_get(r, e);
+    lval* v = k ? lser_get(r, e) : NULL;
+
+    int ok = k && v && lmap_can_key(k);
+    if (ok) lmap_put(x->map, k, v);
+
+    if (k) lval_del(k);
+    if (v) lval_del(v);
+
+    if (!ok) {
+      lval_del(x);
+      return lser_fail(r, "malformed map");
+    }
+  }
+
+  return x;
+}
+
+// Next value, or NULL with `r->error` set
+static lval* lser_get(lser_reader* r, lenv* e) {
+  int tag = lser_byte(r);
+  if (tag < 0) return lser_fail(r, "unexpected end of data");
+
+  if (r->depth == LSER_MAX_DEPTH) return lser_fail(r, "nested too deeply");
+  r->depth++;
+
+  lval* x = NULL;
+  char* s = NULL;
+  unsigned long n;
+
+  switch (tag) {
+    case LSER_NUM:
+      if (!lser_get_uint(r, &n)) {
+        lser_fail(r, "truncated number");
+        break;
+      }
+
+      x = lval_num((long)((n >> 1) ^ -(n & 1)));
+      break;
+
+    case LSER_SYM:
+    case LSER_SYMREF:
+      x = lser_get_sym(r, tag);
+      break;
+
+    case LSER_STR:
+    case LSER_ERR:
+      s = lser_get_bytes(r);
+      if (s == NULL) {
+        lser_fail(r, "truncated string");
+        break;
+      }
+
+      x = tag == LSER_STR ? lval_str(s) : lval_err("%s", s);
+      free(s);
+      break;
+
+    case LSER_SEXPR:
+      x = lser_get_list(r, e, lval_sexpr());
+      break;
+
+    case LSER_QEXPR:
+      x = lser_get_list(r, e, lval_qexpr());
+      break;
+
+    case LSER_LAMBDA:
+      x = lser_get_lambda(r, e);
+      break;
+
+    case LSER_MAP:
+      x = lser_get_map(r, e);
+      break;
+
+    case LSER_BUILTIN: {
+      s = lser_get_bytes(r);
+      lbuiltin f = s ? builtin_named(s) : NULL;
+      free(s);
+
+      if (f == NULL) {
+        lser_fail(r, "unknown builtin");
+        break;
+      }
+
+      x = lval_fun(f);
+      break;
+    }
+
+    default:
+      lser_fail(r, "unknown tag");
+  }
+
+  r->depth--;
+
+  return x;
+}
+
+// Next value in the stream, or NULL once it's over. Functions are given the
+// global scope of `e`
+lval* lser_read(lser_reader* r, lenv* e) {
+  if (r->error) return lval_err("Corrupt data: %s", r->error);
+
+  if (!r->started) {
+    char header[sizeof(LSER_MAGIC)];
+    for (int i = 0; i < (int)sizeof(header); i++) {
+      int c = lser_byte(r);
+      if (c < 0) return lval_err("Not Lispy data");
+      header[i] = c;
+    }
+
+    if (memcmp(header, LSER_MAGIC, sizeof(LSER_MAGIC) - 1) != 0) {
+      return lval_err("Not Lispy data");
+    }
+
+    if (header[sizeof(LSER_MAGIC) - 1] != LSER_VERSION) {
+      return lval_err("Unsupported data version %i",
+                      header[sizeof(LSER_MAGIC) - 1]);
+    }
+
+    r->started = 1;
+  }
+
+  // End of data between values is the end of the stream
+  if (r->pos == r->len) {
+    int c = lser_byte(r);
+    if (c < 0) return NULL;
+    r->pos--;
+  }
+
+  lval* x = lser_get(r, e);
+
+  return x ? x : lval_err("Corrupt data: %s", r->error);
+}
+
+void lser_reader_del(lser_reader* r) {
+  for (int i = 0; i < r->nsyms; i++) free(r->names[i]);
+  free(r->names);
+  if (r->fd >= 0) free(r->buf);
+  free(r);
+}
+
+// Write `v` alone to the file at `path`
+lval* lser_save(char* path, lval* v) {
+  lval* x = lser_unsaveable(v);
+  if (x) return lval_err("Cannot save a %s", ltype_name(x->type));
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return lval_err("Could not open '%s': %s", path, strerror(errno));
+
+  lser_writer* w = lser_writer_new(fd);
+  lser_put(w, v);
+
+  int ok = lser_writer_del(w);
+  int err = errno;
+  if (close(fd) != 0) ok = 0;
+
+  if (!ok) return lval_err("Could not write '%s': %s", path, strerror(err));
+
+  return lval_sexpr();
+}
+
+// Read back the value written to `path` by `lser_save`
+lval* lser_load(lenv* e, char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return lval_err("Could not open '%s': %s", path, strerror(errno));
+
+  lser_reader* r = lser_reader_new(fd);
+  lval* x = lser_read(r, e);
+  if (x == NULL) x = lval_err("Not Lispy data");
+
+  lser_reader_del(r);
+  close(fd);
+
+  return x;
+}
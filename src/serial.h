@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "lval.h"
+
+// Binary encoding of values, so data written by one program can be read back
+// by another without going through the parser.
+//
+// A stream is the magic "LSPB" and a version byte, then values one after the
+// other. Each value is a tag byte and its contents:
+//
+//   NUM        zigzag varint
+//   SYM        varint length and bytes. Symbols are numbered in the order they
+//              first appear, and written out only that once
+//   SYMREF     varint number of a symbol seen before
+//   STR, ERR   varint length and bytes
+//   SEXPR      varint count, then that many values
+//   QEXPR      same
+//   LAMBDA     varint count of captured locals, each a symbol and a value,
+//              then the formals and the body
+//   MAP        varint count, then that many keys and values
+//   BUILTIN    varint length and bytes of the name it's bound to
+//
+// Channels and futures have no encoding
+typedef struct lser_writer lser_writer;
+typedef struct lser_reader lser_reader;
+
+lser_writer* lser_writer_new(int fd);
+lval* lser_write(lser_writer* w, lval* v);
+int lser_writer_del(lser_writer* w);
+
+lser_reader* lser_reader_new(int fd);
+lser_reader* lser_reader_mem(const void* data, size_t size);
+lval* lser_read(lser_reader* r, lenv* e);
+void lser_reader_del(lser_reader* r);
+
+lval* lser_save(char* path, lval* v);
+lval* lser_load(lenv* e, char* path);
@@ -0,0 +1,95 @@
+#include "stats.h"
+
+#include "map.h"
+
+int lstats_enabled = 0;
+lstats lstats_counters;
+
+void lstats_count_alloc(int type) {
+  atomic_fetch_add_explicit(&lstats_counters.allocs[type], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&lstats_counters.bytes, sizeof(lval),
+                            memory_order_relaxed);
+
+  long live = atomic_fetch_add_explicit(&lstats_counters.live, 1,
+                                        memory_order_relaxed) + 1;
+
+  long peak = atomic_load_explicit(&lstats_counters.peak_live,
+                                   memory_order_relaxed);
+  while (live > peak && !atomic_compare_exchange_weak_explicit(
+                            &lstats_counters.peak_live, &peak, live,
+                            memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+void lstats_count_free(void) {
+  atomic_fetch_add_explicit(&lstats_counters.frees, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&lstats_counters.live, 1, memory_order_relaxed);
+}
+
+static void lstats_put(lmap* m, char* key, long n) {
+  lval* k = lval_sym(key);
+  lval* v = lval_num(n);
+
+  lmap_put(m, k, v);
+
+  lval_del(k);
+  lval_del(v);
+}
+
+// The counters as a map, allocations keyed by type name. Ex:
+// #{allocs #{Number 12 ...} bytes 2048 copies 30 ...}
+lval* lstats_map(void) {
+  lmap* allocs = lmap_new();
+  for (int t = 0; t < LSTATS_TYPES; t++) {
+    long n = atomic_load(&lstats_counters.allocs[t]);
+    if (n) lstats_put(allocs, ltype_name(t), n);
+  }
+
+  lmap* m = lmap_new();
+
+  lval* k = lval_sym("allocs");
+  lval* v = lval_map(allocs);
+  lmap_put(m, k, v);
+  lval_del(k);
+  lval_del(v);
+
+  lstats_put(m, "reused", atomic_load(&lstats_counters.reused));
+  lstats_put(m, "frees", atomic_load(&lstats_counters.frees));
+  lstats_put(m, "bytes", atomic_load(&lstats_counters.bytes));
+  lstats_put(m, "copies", atomic_load(&lstats_counters.copies));
+  lstats_put(m, "reallocs", atomic_load(&lstats_counters.reallocs));
+  lstats_put(m, "live", atomic_load(&lstats_counters.live));
+  lstats_put(m, "peak_live", atomic_load(&lstats_counters.peak_live));
+  lstats_put(m, "tries", atomic_load(&lstats_counters.tries));
+  lstats_put(m, "lookahead", atomic_load(&lstats_counters.lookahead));
+
+  return lval_map(m);
+}
+
+void lstats_dump(FILE* out) {
+  fprintf(out, "{\"allocs\": {");
+
+  int printed = 0;
+  for (int t = 0; t < LSTATS_TYPES; t++) {
+    long n = atomic_load(&lstats_counters.allocs[t]);
+    if (n == 0) continue;
+
+    fprintf(out, "%s\"%s\": %li", printed++ ? ", " : "", ltype_name(t), n);
+  }
+
+  fprintf(out,
+          "}, \"reused\": %li, \"frees\": %li, \"bytes\": %li, "
+          "\"copies\": %li, "
+          "\"reallocs\": %li, \"live\": %li, \"peak_live\": %li, "
+          "\"tries\": %li, \"lookahead\": %li}\n",
+          atomic_load(&lstats_counters.reused),
+          atomic_load(&lstats_counters.frees),
+          atomic_load(&lstats_counters.bytes),
+          atomic_load(&lstats_counters.copies),
+          atomic_load(&lstats_counters.reallocs),
+          atomic_load(&lstats_counters.live),
+          atomic_load(&lstats_counters.peak_live),
+          atomic_load(&lstats_counters.tries),
+          atomic_load(&lstats_counters.lookahead));
+}
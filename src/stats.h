@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lval.h"
+
+// Room for every `LVAL_*` type
+#define LSTATS_TYPES 16
+
+// Memory traffic of values. Always compiled in, but only counted once
+// `lstats_enabled` is set, so otherwise each hook costs a branch. Asking for
+// them is an error while it isn't, rather than a map of zeros
+typedef struct lstats {
+  atomic_long allocs[LSTATS_TYPES];
+  atomic_long reused;  // Allocations taken from a free list, not malloc
+  atomic_long frees;
+  atomic_long bytes;     // Values, their strings and cell arrays
+  atomic_long copies;    // Nodes visited by `lval_copy`
+  atomic_long reallocs;  // Cell arrays and environments growing
+  atomic_long live;
+  atomic_long peak_live;
+  atomic_long tries;      // Token automata run by the reader
+  atomic_long lookahead;  // Bytes they looked at past the token they read
+} lstats;
+
+extern int lstats_enabled;
+extern lstats lstats_counters;
+
+void lstats_count_alloc(int type);
+void lstats_count_free(void);
+
+static inline void lstats_alloc(int type) {
+  if (lstats_enabled) lstats_count_alloc(type);
+}
+
+static inline void lstats_free(void) {
+  if (lstats_enabled) lstats_count_free();
+}
+
+static inline void lstats_reuse(void) {
+  if (lstats_enabled) atomic_fetch_add_explicit(&lstats_counters.reused, 1,
+                                                memory_order_relaxed);
+}
+
+static inline void lstats_bytes(size_t n) {
+  if (lstats_enabled) atomic_fetch_add_explicit(&lstats_counters.bytes, n,
+                                                memory_order_relaxed);
+}
+
+static inline void lstats_copy(void) {
+  if (lstats_enabled) atomic_fetch_add_explicit(&lstats_counters.copies, 1,
+                                                memory_order_relaxed);
+}
+
+// A `realloc` to `n` bytes
+static inline void lstats_realloc(size_t n) {
+  if (!lstats_enabled) return;
+
+  atomic_fetch_add_explicit(&lstats_counters.reallocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&lstats_counters.bytes, n, memory_order_relaxed);
+}
+
+// What a reader did, once it's done
+static inline void lstats_read(long tries, long lookahead) {
+  if (!lstats_enabled) return;
+
+  atomic_fetch_add_explicit(&lstats_counters.tries, tries,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&lstats_counters.lookahead, lookahead,
+                            memory_order_relaxed);
+}
+
+lval* lstats_map(void);
+void lstats_dump(FILE* out);
@@ -0,0 +1,408 @@
+// mmap flags and fstat are not part of strict C17
+#define _DEFAULT_SOURCE
+
+#include "view.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "print.h"
+
+#define LVIEW_MAGIC "LSPV"
+#define LVIEW_VERSION 1
+
+enum { LVIEW_NUM, LVIEW_SYM, LVIEW_STR, LVIEW_SEXPR, LVIEW_QEXPR };
+
+typedef struct lview_header {
+  char magic[4];
+  uint32_t version;
+  lview_node root;
+} lview_header;
+
+atomic_int lview_mapped = 0;
+
+lview* lview_ref(lview* m) {
+  atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+  return m;
+}
+
+void lview_unref(lview* m) {
+  if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) != 1) return;
+
+  munmap((void*)m->base, m->size);
+  free(m);
+  atomic_fetch_sub(&lview_mapped, 1);
+}
+
+// Writing. The whole layout is built in memory and written out at once, the
+// cells of each list reserved before any of their contents so they stay
+// consecutive
+
+typedef struct lview_writer {
+  lbuf out;
+
+  // Offsets of the strings written so far, by open addressing on their hash
+  int count;
+  int cap;  // Always a power of two
+  char** strs;
+  uint64_t* offs;
+} lview_writer;
+
+static uint32_t lview_hash(char* s) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+
+  return h;
+}
+
+static int lview_slot(lview_writer* w, char* s) {
+  int i = lview_hash(s) & (w->cap - 1);
+  while (w->strs[i] && strcmp(w->strs[i], s) != 0) i = (i + 1) & (w->cap - 1);
+
+  return i;
+}
+
+static void lview_grow(lview_writer* w) {
+  int cap = w->cap;
+  char** strs = w->strs;
+  uint64_t* offs = w->offs;
+
+  w->cap *= 2;
+  w->strs = calloc(w->cap, sizeof(char*));
+  w->offs = malloc(sizeof(uint64_t) * w->cap);
+
+  for (int i = 0; i < cap; i++) {
+    if (strs[i] == NULL) continue;
+
+    int j = lview_slot(w, strs[i]);
+    w->strs[j] = strs[i];
+    w->offs[j] = offs[i];
+  }
+
+  free(strs);
+  free(offs);
+}
+
+// Offset of the bytes of `s`, written the first time it's seen. The table
+// borrows `s` from the value being saved, which outlives the writer
+static uint64_t lview_put_str(lview_writer* w, char* s) {
+  int i = lview_slot(w, s);
+  if (w->strs[i]) return w->offs[i];
+
+  uint64_t off = w->out.len;
+  lbuf_puts(&w->out, s);
+  lbuf_putc(&w->out, '\0');
+
+  w->strs[i] = s;
+  w->offs[i] = off;
+  if (++w->count * 2 > w->cap) lview_grow(w);
+
+  return off;
+}
+
+static uint64_t lview_put_list(lview_writer* w, lval* v);
+
+static lview_node lview_put_node(lview_writer* w, lval* v) {
+  lview_node n = {0};
+
+  switch (v->type) {
+    case LVAL_NUM:
+      n.type = LVIEW_NUM;
+      n.payload = (uint64_t)v->num;
+      break;
+
+    case LVAL_SYM:
+      n.type = LVIEW_SYM;
+      n.count = strlen(v->sym);
+      n.payload = lview_put_str(w, v->sym);
+      break;
+
+    case LVAL_STR:
+      n.type = LVIEW_STR;
+      n.count = strlen(v->str);
+      n.payload = lview_put_str(w, v->str);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      n.type = v->type == LVAL_SEXPR ? LVIEW_SEXPR : LVIEW_QEXPR;
+      n.count = v->count;
+      n.payload = lview_put_list(w, v);
+      break;
+  }
+
+  return n;
+}
+
+static uint64_t lview_put_list(lview_writer* w, lval* v) {
+  // Nodes are 8 byte aligned
+  while (w->out.len % 8) lbuf_putc(&w->out, '\0');
+
+  uint64_t off = w->out.len;
+  size_t size = sizeof(lview_node) * v->count;
+
+  lbuf_reserve(&w->out, size);
+  memset(w->out.data + off, 0, size);
+  w->out.len += size;
+
+  // Filled in afterwards, since writing a cell can move the buffer
+  for (int i = 0; i < v->count; i++) {
+    lview_node n = lview_put_node(w, v->cell[i]);
+    memcpy(w->out.data + off + sizeof(lview_node) * i, &n, sizeof(n));
+  }
+
+  return off;
+}
+
+// First value in `v` that can't be laid out, if any
+static lval* lview_unmappable(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+    case LVAL_SYM:
+    case LVAL_STR:
+      return NULL;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lval* x = lview_unmappable(v->cell[i]);
+        if (x) return x;
+      }
+
+      return NULL;
+
+    default:
+      return v;
+  }
+}
+
+// Lay out the Q-Expression `v` in the file at `path`
+lval* lview_save(char* path, lval* v) {
+  lval* x = v->type == LVAL_VIEW ? lview_materialize(v) : lval_copy(v);
+
+  if (x->type != LVAL_QEXPR) {
+    lval* err = lval_err("Cannot map a %s", ltype_name(x->type));
+    lval_del(x);
+    return err;
+  }
+
+  lval* bad = lview_unmappable(x);
+  if (bad) {
+    lval* err = lval_err("Cannot map a %s", ltype_name(bad->type));
+    lval_del(x);
+    return err;
+  }
+
+  lview_writer w = {.cap = 64};
+  w.strs = calloc(w.cap, sizeof(char*));
+  w.offs = malloc(sizeof(uint64_t) * w.cap);
+  lbuf_init(&w.out);
+
+  lview_header h = {.magic = LVIEW_MAGIC, .version = LVIEW_VERSION};
+  lbuf_reserve(&w.out, sizeof(h));
+  w.out.len = sizeof(h);
+
+  h.root = lview_put_node(&w, x);
+  memcpy(w.out.data, &h, sizeof(h));
+
+  lval* result = NULL;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    result = lval_err("Could not open '%s': %s", path, strerror(errno));
+  } else {
+    int ok = lbuf_flush(&w.out, fd);
+    int err = errno;
+    if (close(fd) != 0) ok = 0;
+
+    result = ok ? lval_sexpr()
+                : lval_err("Could not write '%s': %s", path, strerror(err));
+  }
+
+  free(w.strs);
+  free(w.offs);
+  lbuf_free(&w.out);
+  lval_del(x);
+
+  return result;
+}
+
+// Reading. Bounds are checked as nodes are reached, so a corrupt file gives
+// errors instead of reads outside the mapping
+
+static int lview_list_ok(lview* m, const lview_node* n) {
+  return n->payload % 8 == 0 && n->payload <= m->size &&
+         n->count <= (m->size - n->payload) / sizeof(lview_node);
+}
+
+static int lview_str_ok(lview* m, const lview_node* n) {
+  return n->payload < m->size && n->count < m->size - n->payload &&
+         m->base[n->payload + n->count] == '\0';
+}
+
+static lval* lview_corrupt(void) { return lval_err("Corrupt view"); }
+
+static lval* lview_list(lview* m, const lview_node* n) {
+  if (!lview_list_ok(m, n)) return lview_corrupt();
+
+  return lval_view(lview_ref(m), (const lview_node*)(m->base + n->payload),
+                   n->count);
+}
+
+static lval* lview_deep(lview* m, const lview_node* n, int depth);
+
+// Node `n` as a value. Q-Expressions stay views, everything else is copied
+static lval* lview_value(lview* m, const lview_node* n) {
+  switch (n->type) {
+    case LVIEW_NUM:
+      return lval_num((long)n->payload);
+
+    case LVIEW_SYM:
+    case LVIEW_STR:
+      if (!lview_str_ok(m, n)) return lview_corrupt();
+
+      return n->type == LVIEW_SYM ? lval_sym((char*)m->base + n->payload)
+                                  : lval_str((char*)m->base + n->payload);
+
+    case LVIEW_QEXPR:
+      return lview_list(m, n);
+
+    case LVIEW_SEXPR:
+      return lview_deep(m, n, 0);
+
+    default:
+      return lview_corrupt();
+  }
+}
+
+// Node `n` copied out in full
+static lval* lview_deep(lview* m, const lview_node* n, int depth) {
+  if (n->type != LVIEW_SEXPR && n->type != LVIEW_QEXPR) {
+    return lview_value(m, n);
+  }
+
+  if (depth == LVIEW_MAX_DEPTH || !lview_list_ok(m, n)) return lview_corrupt();
+
+  lval* x = n->type == LVIEW_SEXPR ? lval_sexpr() : lval_qexpr();
+  const lview_node* cells = (const lview_node*)(m->base + n->payload);
+
+  for (uint32_t i = 0; i < n->count; i++) {
+    lval* c = lview_deep(m, &cells[i], depth + 1);
+
+    if (c->type == LVAL_ERR) {
+      lval_del(x);
+      return c;
+    }
+
+    lval_add(x, c);
+  }
+
+  return x;
+}
+
+// Map the file at `path`, written by `lview_save`
+lval* lview_load(char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return lval_err("Could not open '%s': %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(lview_header)) {
+    close(fd);
+    return lval_err("Not a Lispy view");
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return lval_err("Could not map '%s': %s", path, strerror(errno));
+  }
+
+  const lview_header* h = base;
+  if (memcmp(h->magic, LVIEW_MAGIC, 4) != 0 || h->version != LVIEW_VERSION ||
+      h->root.type != LVIEW_QEXPR) {
+    munmap(base, st.st_size);
+    return lval_err("Not a Lispy view");
+  }
+
+  lview* m = malloc(sizeof(lview));
+  *m = (lview){.refs = 1, .base = base, .size = st.st_size};
+  atomic_fetch_add(&lview_mapped, 1);
+
+  lval* x = lview_list(m, &h->root);
+  lview_unref(m);
+
+  return x;
+}
+
+// Element `i` of the view `v`
+lval* lview_cell(lval* v, int i) { return lview_value(v->view, &v->nodes[i]); }
+
+// The view `v` as an ordinary Q-Expression
+lval* lview_materialize(lval* v) {
+  lview_node n = {
+      .type = LVIEW_QEXPR,
+      .count = v->count,
+      .payload = (const char*)v->nodes - v->view->base,
+  };
+
+  return lview_deep(v->view, &n, 0);
+}
+
+// Equality of two lists, either of them a view, one element at a time. Only
+// as much of a view as it takes to find a difference is read
+int lview_eq(lval* x, lval* y) {
+  if (x->type != LVAL_VIEW && x->type != LVAL_QEXPR) return 0;
+  if (y->type != LVAL_VIEW && y->type != LVAL_QEXPR) return 0;
+  if (x->count != y->count) return 0;
+
+  for (int i = 0; i < x->count; i++) {
+    lval* a = x->type == LVAL_VIEW ? lview_cell(x, i) : x->cell[i];
+    lval* b = y->type == LVAL_VIEW ? lview_cell(y, i) : y->cell[i];
+
+    int eq = lval_eq(a, b);
+
+    if (x->type == LVAL_VIEW) lval_del(a);
+    if (y->type == LVAL_VIEW) lval_del(b);
+
+    if (!eq) return 0;
+  }
+
+  return 1;
+}
+
+// Builtins that take views as they are. Every other one gets them copied out
+// into ordinary Q-Expressions first
+int lview_aware(lbuiltin f) {
+  return f == builtin_head || f == builtin_tail || f == builtin_len ||
+         f == builtin_list || f == builtin_eq || f == builtin_ne ||
+         f == builtin_def || f == builtin_assign || f == builtin_print ||
+         f == builtin_save || f == builtin_save_view;
+}
+
+// Returns `a`, or the error from a view that couldn't be read in its place
+lval* lview_args(lval* a) {
+  lval_own(a);
+
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_VIEW) continue;
+
+    lval* x = lview_materialize(a->cell[i]);
+    if (x->type == LVAL_ERR) {
+      lval_del(a);
+      return x;
+    }
+
+    lval_del(a->cell[i]);
+    a->cell[i] = x;
+  }
+
+  return a;
+}
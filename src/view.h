@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lval.h"
+
+// Read-only Q-Expressions laid out in a file so it can be mapped and used in
+// place. Nothing is read until it's looked at, and then only the cells that
+// are: elements become values one at a time as they're taken, with nested
+// lists staying views, so a large file loads at once and pages in on demand.
+//
+// Offsets are from the start of the file, so it can be mapped anywhere. After
+// the header everything is 16 byte nodes and the strings they point to:
+//
+//   type     LVIEW_NUM, LVIEW_SYM, LVIEW_STR, LVIEW_SEXPR or LVIEW_QEXPR
+//   count    Cells of a list, bytes of a string
+//   payload  The number itself, otherwise the offset of the NUL terminated
+//            bytes or of the `count` consecutive nodes of the list
+//
+// Symbols and strings with the same contents share their bytes
+typedef struct lview_node {
+  uint32_t type;
+  uint32_t count;
+  uint64_t payload;
+} lview_node;
+
+// Deeper than this is taken for a corrupt file looping back on itself
+#define LVIEW_MAX_DEPTH 10000
+
+// A mapped file, shared by every view into it
+typedef struct lview {
+  atomic_int refs;
+  const char* base;
+  size_t size;
+} lview;
+
+// Mappings still alive. While there are none, calls skip looking for views
+// among their arguments
+extern atomic_int lview_mapped;
+
+lview* lview_ref(lview* m);
+void lview_unref(lview* m);
+
+lval* lview_save(char* path, lval* v);
+lval* lview_load(char* path);
+
+lval* lview_cell(lval* v, int i);
+lval* lview_materialize(lval* v);
+int lview_eq(lval* x, lval* y);
+
+int lview_aware(lbuiltin f);
+lval* lview_args(lval* a);
@@ -0,0 +1,627 @@
+#!/usr/bin/env python3
+"""Compile the Lispy grammar into the static tables the reader runs on.
+
+The grammar is written as for mpc's `mpca_lang`. Token rules are regexes,
+compiled here into deterministic automata over classes of bytes that match
+what mpc's would: alternatives and repetitions commit to the first way that
+matches and never backtrack into it, unlike a textbook regex. Where a regex
+can't be matched that way by an automaton, it's refused. `expr`
+becomes a table of the alternatives each byte can start; lists become their
+brackets.
+
+    grammar.py src/lispy.grammar target/grammar.c
+"""
+
+import re
+import sys
+
+# Rules the reader understands, in the order of `LRULE_*` in grammar.h
+RULES = ["number", "symbol", "string", "sexpr", "qexpr"]
+
+# What `mpca_lang` skips after every token
+WHITESPACE = b" \f\n\r\t\v"
+
+LRE_CLASS, LRE_SPLIT, LRE_JMP, LRE_MATCH, LRE_MARK, LRE_CUT = range(6)
+
+
+class GrammarError(Exception):
+    pass
+
+
+# Grammar
+
+
+def tokenize(text):
+    spec = r"""
+        (?P<space>\s+)
+      | (?P<ident>[a-zA-Z_][a-zA-Z0-9_]*)
+      | (?P<ref><[a-zA-Z_][a-zA-Z0-9_]*>)
+      | (?P<lit>'(?:\\.|[^'])*')
+      | (?P<regex>/(?:\\.|[^/])*/)
+      | (?P<op>[:;|*+?()])
+    """
+    pos = 0
+    for m in re.finditer(spec, text, re.VERBOSE):
+        if m.start() != pos:
+            raise GrammarError("unexpected %r" % text[pos])
+        pos = m.end()
+        if m.lastgroup != "space":
+            yield m.lastgroup, m.group()
+    if pos != len(text):
+        raise GrammarError("unexpected %r" % text[pos])
+
+
+def parse_grammar(text):
+    # Rules as lists of alternatives, each a list of (kind, value, repeat)
+    toks = list(tokenize(text))
+    rules = {}
+    i = 0
+
+    def expect(kind, value=None):
+        nonlocal i
+        if i == len(toks) or toks[i][0] != kind or (value and toks[i][1] != value):
+            raise GrammarError("expected %s" % (value or kind))
+        i += 1
+        return toks[i - 1][1]
+
+    while i < len(toks):
+        name = expect("ident")
+        expect("op", ":")
+        alts = [[]]
+        while toks[i] != ("op", ";"):
+            kind, value = toks[i]
+            i += 1
+            if kind == "op" and value == "|":
+                alts.append([])
+                continue
+            if kind not in ("ref", "lit", "regex"):
+                raise GrammarError("%s: unsupported %r" % (name, value))
+            repeat = ""
+            if i < len(toks) and toks[i][0] == "op" and toks[i][1] in "*+?":
+                repeat = toks[i][1]
+                i += 1
+            alts[-1].append((kind, value[1:-1], repeat))
+        expect("op", ";")
+        rules[name] = alts
+
+    return rules
+
+
+# Regexes, in mpc's syntax
+
+
+class Regex:
+    def __init__(self, source):
+        self.src = source.replace("\\/", "/")
+        self.pos = 0
+
+    def peek(self):
+        return self.src[self.pos] if self.pos < len(self.src) else None
+
+    def next(self):
+        c = self.peek()
+        self.pos += 1
+        return c
+
+    def parse(self):
+        node = self.alt()
+        if self.pos != len(self.src):
+            raise GrammarError("regex /%s/: unexpected %r" % (self.src, self.peek()))
+        return node
+
+    def alt(self):
+        node = self.seq()
+        while self.peek() == "|":
+            self.next()
+            node = ("alt", node, self.seq())
+        return node
+
+    def seq(self):
+        items = []
+        while self.peek() not in (None, "|", ")"):
+            atom = self.atom()
+            while self.peek() in ("*", "+", "?"):
+                atom = (self.next(), atom)
+            items.append(atom)
+        return ("seq", items)
+
+    def atom(self):
+        c = self.next()
+        if c == "(":
+            node = self.alt()
+            if self.next() != ")":
+                raise GrammarError("regex /%s/: missing ')'" % self.src)
+            return node
+        if c == "[":
+            return ("class", self.klass())
+        if c == ".":
+            return ("class", frozenset(range(256)))
+        if c in "^$":
+            raise GrammarError("regex /%s/: anchors only delimit `lispy`" % self.src)
+        if c == "\\":
+            return ("class", self.escape(self.next()))
+        return ("class", frozenset([ord(c)]))
+
+    def escape(self, c):
+        named = {
+            "d": b"0123456789",
+            "s": WHITESPACE,
+            "w": b"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_",
+        }
+        if c in named:
+            return frozenset(named[c])
+        controls = {"a": 7, "b": 8, "f": 12, "n": 10, "r": 13, "t": 9, "v": 11}
+        return frozenset([controls.get(c, ord(c))])
+
+    def klass(self):
+        negate = self.peek() == "^"
+        if negate:
+            self.next()
+
+        chars = set()
+        while self.peek() != "]":
+            c = self.next()
+            if c is None:
+                raise GrammarError("regex /%s/: missing ']'" % self.src)
+            lo = self.escape(self.next()) if c == "\\" else frozenset([ord(c)])
+            if self.peek() == "-" and self.src[self.pos + 1] != "]" and len(lo) == 1:
+                self.next()
+                hi = self.next()
+                hi = self.escape(self.next()) if hi == "\\" else frozenset([ord(hi)])
+                chars.update(range(min(lo), max(hi) + 1))
+            else:
+                chars.update(lo)
+        self.next()
+
+        return frozenset(range(256)) - chars if negate else frozenset(chars)
+
+
+class Program:
+    # Instructions shared by every token, and the byte sets they test
+    def __init__(self):
+        self.classes = []
+
+    def klass(self, chars):
+        if chars not in self.classes:
+            self.classes.append(chars)
+        return self.classes.index(chars)
+
+    def compile(self, node):
+        self.insts = []
+        self.emit(node)
+        self.insts.append([LRE_MATCH, 0, 0])
+        return self.insts
+
+    def compile_choice(self, alternatives):
+        # Alternatives tried in order, each matching with its own label
+        self.insts = []
+        for i, (label, node) in enumerate(alternatives):
+            split = len(self.insts)
+            if i < len(alternatives) - 1:
+                self.insts.append([LRE_SPLIT, split + 1, 0])
+            self.emit(node)
+            self.insts.append([LRE_MATCH, label, 0])
+            if i < len(alternatives) - 1:
+                self.insts[split][2] = len(self.insts)
+        return self.insts
+
+    def emit(self, node):
+        insts = self.insts
+        kind = node[0]
+
+        if kind == "class":
+            insts.append([LRE_CLASS, self.klass(node[1]), 0])
+        elif kind == "seq":
+            for item in node[1]:
+                self.emit(item)
+        elif kind == "alt":
+            self.choice(node[1], node[2])
+        elif kind == "?":
+            self.choice(node[1], None)
+        elif kind == "*":
+            self.choice(node[1], None, loop=True)
+        elif kind == "+":
+            self.emit(node[1])
+            self.choice(node[1], None, loop=True)
+
+    def choice(self, first, second, loop=False):
+        # `first`, else `second` or nothing, as mpc's combinators do it: once
+        # `first` has matched it's kept, whatever comes after fails. The mark
+        # is where a backtracking matcher would stop backtracking, and the cut
+        # drops everything it could still try inside. A loop goes round while
+        # `first` matches, and never gives back what it took
+        insts = self.insts
+        mark = len(insts)
+        insts.append([LRE_MARK, mark, 0])
+        split = len(insts)
+        insts.append([LRE_SPLIT, split + 1, 0])
+        self.emit(first)
+        insts.append([LRE_CUT, mark, 0])
+        jmp = len(insts)
+        insts.append([LRE_JMP, mark, 0])
+        insts[split][2] = len(insts)
+        if second:
+            self.emit(second)
+        insts.append([LRE_CUT, mark, 0])
+        if not loop:
+            insts[jmp][1] = len(insts)
+
+    # The automata simulate a backtracking matcher on every path at once. A
+    # path is where it is in the program and its stack of marks and of the
+    # alternatives it would backtrack to, in the order it would try them. Each
+    # alternative is itself a path, run alongside with its own copy of the
+    # stack below it, so it's ready if everything before it fails. The first
+    # alternative on a path's stack is the one tried after it.
+    #
+    # Following those from the start gives the order every path would be
+    # tried in. The first of them to reach the match is the one a state
+    # accepts, and becomes a leaf that stays until something before it
+    # matches or cuts it. The reader takes the last position the automaton
+    # accepted, so only that leaf can be the result: when anything else would
+    # be, or when the leaf is cut and nothing matches after, the regex can't
+    # be matched this way and the generator says so
+
+    def run(self, insts, pc, stack, cut, seen=frozenset()):
+        # Follow a path through everything that doesn't consume a byte. `cut`
+        # collects whether it dropped the leaf the reader last took
+        seen = set(seen)
+        while True:
+            if pc in seen:
+                raise GrammarError("a repetition can match nothing")
+            seen.add(pc)
+
+            op, x, y = insts[pc]
+            if op == LRE_JMP:
+                pc = x
+            elif op == LRE_SPLIT:
+                stack = (("alt", self.run(insts, y, stack, cut, seen)),) + stack
+                pc = x
+            elif op == LRE_MARK:
+                stack = (("mark", x),) + stack
+                pc += 1
+            elif op == LRE_CUT:
+                end = stack.index(("mark", x)) + 1
+                if any(self.holds(item, ("leaf", True)) for item in stack[:end]):
+                    cut.append(True)
+                stack = stack[end:]
+                pc += 1
+            else:
+                return (pc, stack if op == LRE_CLASS else ())
+
+    def holds(self, item, leaf):
+        if item[:2] == leaf:
+            return True
+        if item[0] == "alt":
+            return self.holds(item[1], leaf)
+        if isinstance(item[0], int):
+            return any(self.holds(x, leaf) for x in item[1])
+        return False
+
+    def record(self, insts, path, label):
+        # Make every path that just matched with `label` the reader's leaf, and
+        # any older ones no longer so. Copies of a path that matched are the
+        # same match, so they're all taken
+        if path[0] == "leaf":
+            return ("leaf", False, path[2])
+        pc, stack = path
+        if insts[pc][0] == LRE_MATCH:
+            return ("match", label) if insts[pc][1] == label else path
+        return (pc, tuple(("alt", self.record(insts, x, label)) if kind == "alt" else (kind, x)
+                          for kind, x in stack))
+
+    def step(self, insts, path, b, cut):
+        # `path` after byte `b`, None once it and all it could backtrack to
+        # have failed
+        if path[0] == "leaf":
+            return path
+        if path[0] == "match":
+            return ("leaf", True, path[1])
+
+        pc, stack = path
+        op, x, _ = insts[pc]
+        if op == LRE_MATCH:
+            return ("leaf", False, x)
+
+        stack = tuple((kind, self.step(insts, item, b, cut)) if kind == "alt" else (kind, item)
+                      for kind, item in stack)
+        stack = tuple(item for item in stack if item[1] is not None)
+
+        if op == LRE_CLASS and b in self.classes[x]:
+            return self.run(insts, pc + 1, stack, cut)
+        for kind, item in stack:
+            if kind == "alt":
+                return item
+        return None
+
+    def settle(self, insts, path):
+        # Label of the first path in trying order to have just matched, None
+        # if it's an older leaf or there's none
+        while path[0] != "leaf":
+            pc, stack = path
+            if insts[pc][0] == LRE_MATCH:
+                return insts[pc][1]
+            alts = [item for kind, item in stack if kind == "alt"]
+            if not alts:
+                return None
+            path = alts[0]
+
+        if not path[1]:
+            raise GrammarError("a token would end where the automaton can't tell")
+        return None
+
+    def accepts(self, path):
+        while isinstance(path[0], int):
+            alts = [item for kind, item in path[1] if kind == "alt"]
+            if not alts:
+                return 0
+            path = alts[0]
+        return path[1] + 1 if path[0] == "match" else 0
+
+    def determinize(self, insts):
+        # Subset construction over paths, so the automaton ends a token where
+        # mpc's regexes would. Not simply the longest match: in /"(\\.|[^"])*"/
+        # a backslash always escapes the next byte, even where taking it as a
+        # plain byte would let the string end, and `*` never gives back what
+        # it took.
+        #
+        # A state is the path from the start, and whether the leaf the reader
+        # took was cut. State 0 is dead and 1 the start; each state has its
+        # successor for every byte, and one more than the label of its match,
+        # 0 if none. Once only a leaf is left the token has ended, so that
+        # state is dead too
+        def settled(path, cut):
+            if path is None or path[0] == "leaf":
+                if cut:
+                    raise GrammarError("a token would end where the automaton can't tell")
+                return None
+            label = self.settle(insts, path)
+            if label is not None:
+                return (self.record(insts, path, label), False)
+            return (path, cut)
+
+        cut = []
+        start = settled(self.run(insts, 0, (), cut), bool(cut))
+        states, index = [None, start], {None: 0, start: 1}
+        table = [[0] * 256]
+
+        i = 1
+        while i < len(states):
+            path, was_cut = states[i]
+            row = []
+            for b in range(256):
+                cut = []
+                nxt = settled(self.step(insts, path, b, cut), was_cut or bool(cut))
+                if nxt not in index:
+                    index[nxt] = len(states)
+                    states.append(nxt)
+                row.append(index[nxt])
+            table.append(row)
+            i += 1
+
+            if len(states) > 256:
+                raise GrammarError("a token needs more than 256 states")
+
+        accept = [self.accepts(st[0]) if st else 0 for st in states]
+        return table, accept
+
+    def first(self, insts, pc=0, seen=None):
+        # Bytes the program can consume first
+        seen = set() if seen is None else seen
+        if pc in seen:
+            return set()
+        seen.add(pc)
+
+        op, x, y = insts[pc]
+        if op == LRE_CLASS:
+            return set(self.classes[x])
+        if op in (LRE_MARK, LRE_CUT):
+            return self.first(insts, pc + 1, seen)
+        if op == LRE_JMP:
+            return self.first(insts, x, seen)
+        if op == LRE_SPLIT:
+            return self.first(insts, x, seen) | self.first(insts, y, seen)
+        raise GrammarError("token rules can't match nothing")
+
+
+# Checking the grammar has the shape the reader expects
+
+
+def single(rules, name, kind):
+    alts = rules.get(name)
+    if alts is None:
+        raise GrammarError("missing rule `%s`" % name)
+    if len(alts) != 1 or len(alts[0]) != 1 or alts[0][0][0] != kind or alts[0][0][2]:
+        return None
+    return alts[0][0][1]
+
+
+def compile_grammar(rules):
+    prog = Program()
+    tokens = {}
+    regexes = {}
+    brackets = {}
+    first = {}
+
+    for name in RULES:
+        regex = single(rules, name, "regex")
+        if regex is not None:
+            regexes[name] = Regex(regex).parse()
+            insts = prog.compile(regexes[name])
+            first[name] = prog.first(insts)
+            tokens[name] = prog.determinize(insts)
+            continue
+
+        alts = rules[name]
+        if (len(alts) == 1 and [k for k, _, _ in alts[0]] == ["lit", "ref", "lit"]
+                and alts[0][1][1:] == ("expr", "*")
+                and all(len(alts[0][i][1]) == 1 for i in (0, 2))):
+            brackets[name] = (alts[0][0][1], alts[0][2][1])
+            first[name] = {ord(alts[0][0][1])}
+            continue
+
+        raise GrammarError("`%s` must be a regex or brackets around <expr>*" % name)
+
+    order = []
+    for alt in rules.get("expr", []):
+        if len(alt) != 1 or alt[0][0] != "ref" or alt[0][1] not in RULES or alt[0][2]:
+            raise GrammarError("`expr` must be a choice of %s" % ", ".join(RULES))
+        order.append(RULES.index(alt[0][1]))
+    if sorted(order) != list(range(len(RULES))):
+        raise GrammarError("`expr` must be a choice of %s" % ", ".join(RULES))
+
+    lispy = rules.get("lispy")
+    if lispy != [[("regex", "^", ""), ("ref", "expr", "*"), ("regex", "$", "")]]:
+        raise GrammarError("`lispy` must be /^/ <expr>* /$/")
+
+    # A list is known from its first byte. Tokens can share theirs, so they
+    # are matched all at once, by one automaton that makes the choice `expr`
+    # would in the same pass that finds where the token ends
+    opens = [ord(open) for open, _ in brackets.values()]
+    for b in opens:
+        if opens.count(b) > 1 or any(b in first[name] for name in tokens):
+            raise GrammarError("%r starts a list but also something else" % chr(b))
+
+    choice = prog.determinize(prog.compile_choice(
+        [(r, regexes[RULES[r]]) for r in order if RULES[r] in regexes]))
+
+    return prog, tokens, choice, brackets, first, order
+
+
+# Output
+
+
+def c_char(c):
+    return "'\\''" if c == "'" else "'\\\\'" if c == "\\" else "'%s'" % c
+
+
+def bytes_table(name, values):
+    lines = ["const uint8_t %s[256] = {" % name]
+    for i in range(0, 256, 16):
+        lines.append("    " + ", ".join("%d" % v for v in values[i:i + 16]) + ",")
+    lines.append("};")
+    return lines
+
+
+def generate(source, rules):
+    prog, tokens, choice, brackets, first, order = compile_grammar(rules)
+
+    # Every automaton, the choice last, as (name in the tables, table, accept)
+    automata = [(name,) + tokens[name] for name in RULES if name in tokens]
+    automata.append(("choice",) + choice)
+
+    out = ["// Generated by tools/grammar.py from %s. Do not edit" % source,
+           "",
+           '#include "../src/grammar.h"',
+           "",
+           "#include <stddef.h>",
+           ""]
+
+    out.append("const char* const lgrammar_names[LRULE_COUNT] = {")
+    out += ['    "%s",' % name for name in RULES]
+    out += ["};", ""]
+
+    # Bytes every automaton treats the same share a class, so rows are only
+    # as wide as the number of classes
+    columns = [tuple(row[b] for _, table, _ in automata for row in table)
+               for b in range(256)]
+    distinct = sorted(set(columns), key=columns.index)
+    classes = [distinct.index(c) for c in columns]
+
+    out += ["const int lgrammar_class_count = %d;" % len(distinct), ""]
+    out += bytes_table("lgrammar_bytes", classes) + [""]
+
+    # Runs the reader skips at once: whitespace, and the bytes each state
+    # loops on
+    sets = [frozenset(WHITESPACE)]
+    runs = {}
+    for name, table, _ in automata:
+        runs[name] = []
+        for state, row in enumerate(table):
+            loop = frozenset(b for b in range(256) if state and row[b] == state)
+            if not loop:
+                runs[name].append("LRUN_NONE")
+                continue
+            if loop not in sets:
+                sets.append(loop)
+            runs[name].append("%d" % sets.index(loop))
+
+    out.append("const lbyteset lgrammar_sets[] = {")
+    for chars in sets:
+        lo = [sum(1 << h for h in range(8) if h << 4 | l in chars) for l in range(16)]
+        hi = [sum(1 << (h - 8) for h in range(8, 16) if h << 4 | l in chars)
+              for l in range(16)]
+        out.append("    {")
+        out.append("        .lo = {" + ", ".join("0x%02x" % x for x in lo) + "},")
+        out.append("        .hi = {" + ", ".join("0x%02x" % x for x in hi) + "},")
+        out.append("        .bytes = {")
+        flags = [int(b in chars) for b in range(256)]
+        for i in range(0, 256, 32):
+            out.append("            " + ", ".join("%d" % v for v in flags[i:i + 32]) + ",")
+        out.append("        },")
+        out.append("    },")
+    out += ["};", ""]
+
+    for name, table, accept in automata:
+        out.append("static const uint8_t lgrammar_%s_next[][%d] = {" % (name, len(distinct)))
+        for row in table:
+            cells = [row[classes.index(c)] for c in range(len(distinct))]
+            out.append("    {" + ", ".join("%d" % x for x in cells) + "},")
+        out += ["};", ""]
+
+        out.append("static const uint8_t lgrammar_%s_accept[] = {" % name)
+        out.append("    " + ", ".join("%d" % x for x in accept) + ",")
+        out += ["};", ""]
+
+        out.append("static const uint8_t lgrammar_%s_run[] = {" % name)
+        out.append("    " + ", ".join(runs[name]) + ",")
+        out += ["};", ""]
+
+    out.append("const ldfa lgrammar_tokens[LRULE_COUNT] = {")
+    out += ["    {lgrammar_%s_next[0], lgrammar_%s_accept, lgrammar_%s_run},"
+            % (name, name, name) if name in tokens else "    {NULL, NULL, NULL},"
+            for name in RULES]
+    out += ["};", ""]
+
+    out.append("const ldfa lgrammar_choice = {")
+    out.append("    lgrammar_choice_next[0], lgrammar_choice_accept, lgrammar_choice_run,")
+    out += ["};", ""]
+
+    for i, which in enumerate(("open", "close")):
+        out.append("const char lgrammar_%s[LRULE_COUNT] = {" % which)
+        out += ["    %s," % (c_char(brackets[name][i]) if name in brackets else "0")
+                for name in RULES]
+        out += ["};", ""]
+
+    out.append("const uint8_t lgrammar_order[LRULE_COUNT] = {")
+    out += ["    %d," % r for r in order]
+    out += ["};", ""]
+
+    closes = {ord(close) for _, close in brackets.values()}
+    for b in closes:
+        if any(b in first[name] for name in RULES):
+            raise GrammarError("%r closes a list but also starts an expression" % chr(b))
+
+    bits = [sum(1 << r for r, name in enumerate(RULES) if b in first[name])
+            | (1 << len(RULES) if b in closes else 0) for b in range(256)]
+    out += bytes_table("lgrammar_first", bits)
+
+    return "\n".join(out) + "\n"
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__.strip().splitlines()[-1].strip())
+
+    source, output = sys.argv[1:]
+    try:
+        with open(source) as f:
+            code = generate(source, parse_grammar(f.read()))
+    except GrammarError as e:
+        sys.exit("%s: %s" % (source, e))
+
+    with open(output, "w") as f:
+        f.write(code)
+
+
+if __name__ == "__main__":
+    main()